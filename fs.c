@@ -1,13 +1,68 @@
 #include "fs.h"
+#include "fs_ext.h"
 #include "disk.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 // Constants
 #define MAX_FILE_NAME_LENGTH 15 // Maximum length of a file name
 #define MAX_FILE_DESCRIPTOR_COUNT 32 // Maximum number of file descriptors
 #define MAX_FILE_COUNT 64 // Maximum number of files
-#define MAX_FILE_SIZE (1024 * 1024) // Maximum file size (1 MiB)
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096 // Size of a disk block in bytes
+#endif
+#ifndef DISK_BLOCKS
+#define DISK_BLOCKS 8192 // Number of blocks on the virtual disk
+#endif
+#define DIRECT_BLOCKS 12 // Block pointers held directly in the inode
+#define INODE_SIZE 256 // Bytes per inode; divides BLOCK_SIZE so every inode lies in a single block
+#define INLINE_DATA_SIZE (INODE_SIZE - 16) // Largest file stored inside its inode instead of in data blocks
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int)) // Block pointers held by one indirect block
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) // Blocks reachable from one inode
+#define MAX_FILE_SIZE ((long long)MAX_FILE_BLOCKS * BLOCK_SIZE) // Maximum file size (about 4 GiB)
+#define MAX_IO_SIZE (INT_MAX / BLOCK_SIZE * BLOCK_SIZE) // Most bytes one read or write moves, so the count fits the int it returns
+#define MAX_DATA_BLOCKS DISK_BLOCKS // Upper bound on data blocks tracked by the bitmap
+#define INDIRECT_CACHE_SIZE 4 // Indirect blocks kept in memory per inode
+#define BMAP_ERROR -2 // bmap failed to read an indirect block
+#define MAX_ASYNC_REQUESTS 256 // Asynchronous requests that can be outstanding at once
+#define ASYNC_WORKER_COUNT 4 // Threads executing asynchronous requests
+#define ASYNC_MAX_BATCH 32 // Requests merged into one file system call
+#define ASYNC_MAX_MERGE_BYTES (1024 * 1024) // Largest merged transfer
+#define READAHEAD_BLOCKS 16 // Blocks prefetched per read once access looks sequential
+#define JOURNAL_BLOCKS 32 // Blocks reserved for the metadata journal
+#define JOURNAL_CAPACITY (JOURNAL_BLOCKS - 1) // Metadata blocks logged per journal write (one block is the header)
+#define COMMIT_INTERVAL_MS 1000 // Longest a metadata change stays uncommitted; the commit thread writes it out even when no operation follows
+#define FS_MAGIC 0x45433447 // Identifies a formatted disk with the current layout
+#define JOURNAL_MAGIC 0x4A524E4C // Identifies a valid journal header
+
+// Disk layout: super block, journal, inode table, bitmap, root directory, data blocks
+#define BLOCKS_FOR(bytes) (((bytes) + BLOCK_SIZE - 1) / BLOCK_SIZE) // Blocks needed to hold a number of bytes
+#define INODE_TABLE_BLOCKS BLOCKS_FOR(sizeof(struct Inode) * MAX_FILE_COUNT)
+#define BITMAP_BLOCKS BLOCKS_FOR((MAX_DATA_BLOCKS + 7) / 8)
+#define DIRECTORY_BLOCKS BLOCKS_FOR(sizeof(struct DirectoryEntry) * MAX_FILE_COUNT)
+#define METADATA_BLOCKS (1 + JOURNAL_BLOCKS + INODE_TABLE_BLOCKS + BITMAP_BLOCKS + DIRECTORY_BLOCKS)
+
+// Inode flags
+#define INODE_INLINE 0x1 // File data lives in inline_data rather than in data blocks
+
+// Descriptor states
+#define FD_FREE 0 // Slot can be claimed
+#define FD_CLAIMED 1 // Slot claimed by fs_open, not yet usable
+#define FD_OPEN 2 // Descriptor is open
+
+// Asynchronous request states
+#define ASYNC_FREE 0 // Slot can be used for a new request
+#define ASYNC_QUEUED 1 // Waiting for a worker
+#define ASYNC_RUNNING 2 // Being executed by a worker
+#define ASYNC_DONE 3 // Finished, result waiting for fs_poll or fs_wait
 
 // Data structures
 struct SuperBlock {
@@ -15,11 +70,26 @@ struct SuperBlock {
     int data_blocks_offset; // Offset of the data blocks on disk
     int bitmap_offset; // Offset of the bitmap on disk
     int root_directory_offset; // Offset of the root directory on disk
+    int magic; // FS_MAGIC once the disk has been formatted
+    int journal_offset; // Offset of the metadata journal on disk
+    int journal_blocks; // Number of blocks in the journal
+    int data_block_count; // Number of data blocks after data_blocks_offset
+    int clean; // Non-zero if the file system was unmounted cleanly; cleared on disk before the first write after mount
+    int journal_sequence; // Number of the last committed transaction, saved by a clean unmount
 };
 
 struct Inode {
-    int size; // Size of the file in bytes
-    int data_block_offsets[256]; // Offsets of data blocks on disk
+    long long size; // Size of the file in bytes
+    int in_use; // Non-zero if the inode belongs to a file
+    int flags; // INODE_* flags
+    union {
+        struct {
+            int direct_blocks[DIRECT_BLOCKS]; // Offsets of the first data blocks on disk, -1 if unallocated
+            int single_indirect; // Block holding offsets of the next POINTERS_PER_BLOCK data blocks
+            int double_indirect; // Block holding offsets of single indirect blocks for the rest of the file
+        };
+        char inline_data[INLINE_DATA_SIZE]; // Contents of an INODE_INLINE file; bytes past size are zero
+    };
 };
 
 struct DirectoryEntry {
@@ -27,41 +97,1177 @@ struct DirectoryEntry {
     int inode_index; // Index of the corresponding inode in the inode table
 };
 
+struct JournalHeader {
+    int magic; // JOURNAL_MAGIC if the journal holds a committed transaction
+    int sequence; // Number of the last committed transaction
+    int count; // Number of metadata blocks logged after the header
+    unsigned int checksum; // Checksum of the logged blocks, detects a torn journal write
+    int target_blocks[JOURNAL_CAPACITY]; // Home location of each logged block
+};
+
+struct IndirectBlock {
+    int block; // Data block holding these pointers, -1 if the slot is empty
+    int dirty; // Non-zero if the pointers changed since they were read
+    unsigned int last_used; // Clock value of the last access, for LRU eviction
+    int pointers[POINTERS_PER_BLOCK]; // Data block offsets, -1 if unallocated
+};
+
+struct IndirectCache {
+    pthread_mutex_t lock; // Protects the cache; readers share the inode's rwlock but still change the cache
+    unsigned int clock; // Advances on every indirect block access
+    struct IndirectBlock entries[INDIRECT_CACHE_SIZE];
+};
+
+struct AsyncRequest {
+    int state; // ASYNC_FREE, ASYNC_QUEUED, ASYNC_RUNNING or ASYNC_DONE
+    int is_write; // Non-zero for fs_submit_write
+    int fd; // Descriptor the request operates on
+    void *buf; // Caller's buffer
+    size_t nbyte; // Bytes to transfer
+    off_t offset; // File offset of the transfer
+    int result; // Bytes transferred, or -1 on error
+    void (*callback)(int request, int result, void *arg); // Called on completion instead of fs_poll/fs_wait if set
+    void *arg; // Passed to callback
+    int next; // Next queued request, -1 at the tail
+};
+
+struct MetadataRegion {
+    int *offset; // Super block field holding the region's first block on disk
+    void *base; // In-memory copy of the region
+    size_t size; // Size of the region in bytes
+};
+
+struct OpenFile {
+    int state; // FD_FREE, FD_CLAIMED or FD_OPEN, changed atomically
+    pthread_mutex_t lock; // Serializes calls that share this descriptor
+    int inode_index; // Index of the open file's inode
+    off_t offset; // Current read/write position in bytes
+    int flags; // Flags passed when the file was opened
+    int next_block; // File block the next access hits if it is sequential
+    char *ra_buf; // Readahead buffer, allocated on first sequential read
+    int ra_first; // First file block held in ra_buf
+    int ra_count; // Number of valid blocks in ra_buf
+    char *wb_buf; // Write buffer gathering small writes into one block
+    int wb_block; // File block held in wb_buf, -1 if none
+    int wb_dirty; // Non-zero if wb_buf has not been written to disk
+};
+
 // Global variables
 struct SuperBlock super_block; // Super block
 struct Inode inode_table[MAX_FILE_COUNT]; // Inode table
 struct DirectoryEntry root_directory[MAX_FILE_COUNT]; // Root directory
-int file_descriptor_table[MAX_FILE_DESCRIPTOR_COUNT]; // File descriptor table
-int bitmap[256]; // Bitmap to track free blocks on disk
+struct OpenFile file_descriptor_table[MAX_FILE_DESCRIPTOR_COUNT]; // Open file table, one entry per fd
+unsigned char bitmap[(MAX_DATA_BLOCKS + 7) / 8]; // Bitmap to track free blocks on disk, one bit per block
+unsigned char pending_free[(MAX_DATA_BLOCKS + 7) / 8]; // Blocks freed since the last commit; the committed inodes may still point at them
+int pending_free_count; // Number of bits set in pending_free
+int allocation_starved; // Set atomically when an allocation failed only because the free blocks wait for the commit
+__thread int allocation_starved_here; // Same, for allocations made by this thread
+struct IndirectCache indirect_caches[MAX_FILE_COUNT]; // Recently used indirect blocks of each inode, so files never evict each other's
+int free_block_hint; // Where the next free block search starts
+
+// Locks, in the order they are taken: fs_lock is held shared by every operation and exclusively
+// by commits and umount, then a descriptor's lock, the directory lock, an inode lock, and finally
+// that inode's indirect cache lock, the allocator, metadata, fault, super block, disk and map dirty locks
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER; // Excludes operations from journal commits
+pthread_rwlock_t directory_lock = PTHREAD_RWLOCK_INITIALIZER; // Protects root_directory and inode allocation
+pthread_rwlock_t inode_locks[MAX_FILE_COUNT]; // Protects each inode, its data and the descriptor buffers caching it
+pthread_mutex_t allocator_lock = PTHREAD_MUTEX_INITIALIZER; // Protects bitmap, pending_free, pending_free_count and free_block_hint
+pthread_mutex_t metadata_lock = PTHREAD_MUTEX_INITIALIZER; // Protects dirty_metadata and last_commit_ms
+pthread_mutex_t fault_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes reading metadata blocks in on first use
+pthread_mutex_t super_block_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes clearing the clean flag on disk
+pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER; // disk.h keeps a single file position, so calls into it are serialized
+pthread_mutex_t map_dirty_lock = PTHREAD_MUTEX_INITIALIZER; // Protects map_dirty and its bounds
+pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+// Asynchronous I/O
+struct AsyncRequest async_requests[MAX_ASYNC_REQUESTS]; // Outstanding asynchronous requests
+int async_head = -1; // First queued request, -1 if the queue is empty
+int async_tail = -1; // Last queued request
+int async_in_flight; // Requests queued or running
+int async_running; // Non-zero while the worker threads are alive
+pthread_t async_workers[ASYNC_WORKER_COUNT];
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER; // Protects everything above; taken before no other lock
+pthread_cond_t async_queue_cond = PTHREAD_COND_INITIALIZER; // Signalled when a request is queued or workers should stop
+pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER; // Signalled when a request completes
+
+// Background commits
+int commit_thread_running; // Non-zero while the commit thread should keep going
+pthread_t commit_thread;
+pthread_mutex_t commit_thread_lock = PTHREAD_MUTEX_INITIALIZER; // Protects commit_thread_running; never held while taking another lock
+pthread_cond_t commit_thread_cond; // Wakes the commit thread to stop it; waits on CLOCK_MONOTONIC, set up by init_locks
+
+// Metadata tables written through the journal, in disk order
+#define INODE_REGION 0
+#define BITMAP_REGION 1
+#define DIRECTORY_REGION 2
+#define METADATA_REGION_COUNT 3
+struct MetadataRegion metadata_regions[METADATA_REGION_COUNT] = {
+    {&super_block.inode_table_offset, inode_table, sizeof(inode_table)},
+    {&super_block.bitmap_offset, bitmap, sizeof(bitmap)},
+    {&super_block.root_directory_offset, root_directory, sizeof(root_directory)},
+};
+unsigned char dirty_metadata[METADATA_BLOCKS]; // Metadata blocks changed since the last commit
+unsigned char metadata_loaded[METADATA_BLOCKS]; // Metadata blocks read from disk since the mount, set atomically
+int dirty_metadata_count; // Number of entries set in dirty_metadata
+long long last_commit_ms; // Monotonic time of the last commit, in milliseconds
+int journal_sequence; // Number of the last committed transaction
+
+// Disk backend
+char *disk_map; // Mapping of the disk image when mounted with FS_MOUNT_MMAP, NULL otherwise
+size_t disk_map_size; // Size of disk_map in bytes
+int disk_map_fd = -1; // Descriptor of the mapped disk image
+unsigned char map_dirty[DISK_BLOCKS]; // Blocks written through the mapping and not msynced since
+int map_dirty_first = DISK_BLOCKS; // Lowest block that may be set in map_dirty
+int map_dirty_last = -1; // Highest block that may be set in map_dirty
+long long disk_read_calls; // Block reads issued by the file system
+long long disk_blocks_read; // Blocks covered by those reads
+long long disk_write_calls; // Block writes issued by the file system
+long long disk_blocks_written; // Blocks covered by those writes
+
+int disk_range_valid(int block, int count) { // Check that a block range lies inside the mapping
+    return block >= 0 && count >= 0 && (size_t)(block + count) * BLOCK_SIZE <= disk_map_size;
+}
+
+void count_disk_read(int count) { // Account one read of count blocks in the I/O statistics
+    __atomic_add_fetch(&disk_read_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&disk_blocks_read, count, __ATOMIC_RELAXED);
+}
+
+int disk_read(int block, int count, void *buf) { // Read blocks through the active backend
+    count_disk_read(count);
+    if (disk_map == NULL) {
+        pthread_mutex_lock(&disk_lock);
+        int ret = read_blocks(block, count, buf);
+        pthread_mutex_unlock(&disk_lock);
+        return ret;
+    }
+    if (!disk_range_valid(block, count)) {
+        return -1; // Range is outside the disk
+    }
+    memcpy(buf, disk_map + (size_t)block * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+int mark_disk_dirty(); // Defined with the journal, which owns the super block
+int msync_blocks(int block, int count);
+
+void mark_map_dirty(int block, int count) { // Remember mapped blocks written since their last msync
+    pthread_mutex_lock(&map_dirty_lock);
+    int end = block + count < DISK_BLOCKS ? block + count : DISK_BLOCKS;
+    for (int b = block; b < end; b++) {
+        map_dirty[b] = 1;
+    }
+    if (block < map_dirty_first) {
+        map_dirty_first = block;
+    }
+    if (end - 1 > map_dirty_last) {
+        map_dirty_last = end - 1;
+    }
+    pthread_mutex_unlock(&map_dirty_lock);
+    if (block + count > end) {
+        msync_blocks(end, block + count - end); // An image larger than DISK_BLOCKS; nothing tracks the tail, so sync it now
+    }
+}
+
+int disk_write(int block, int count, const void *buf) { // Write blocks through the active backend
+    // The disk stops being clean before anything other than the super block changes
+    if (block != 0 && __atomic_load_n(&super_block.clean, __ATOMIC_ACQUIRE) && mark_disk_dirty() == -1) {
+        return -1; // Error clearing the clean flag
+    }
+    __atomic_add_fetch(&disk_write_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&disk_blocks_written, count, __ATOMIC_RELAXED);
+    if (disk_map == NULL) {
+        pthread_mutex_lock(&disk_lock);
+        int ret = write_blocks(block, count, (void *)buf);
+        pthread_mutex_unlock(&disk_lock);
+        return ret;
+    }
+    if (!disk_range_valid(block, count)) {
+        return -1; // Range is outside the disk
+    }
+    memcpy(disk_map + (size_t)block * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    mark_map_dirty(block, count);
+    return 0;
+}
+
+void fs_get_io_stats(long long *read_calls, long long *blocks_read, long long *write_calls, long long *blocks_written) { // Block I/O issued since the program started
+    *read_calls = __atomic_load_n(&disk_read_calls, __ATOMIC_RELAXED);
+    *blocks_read = __atomic_load_n(&disk_blocks_read, __ATOMIC_RELAXED);
+    *write_calls = __atomic_load_n(&disk_write_calls, __ATOMIC_RELAXED);
+    *blocks_written = __atomic_load_n(&disk_blocks_written, __ATOMIC_RELAXED);
+}
+
+int msync_blocks(int block, int count) { // msync a range of mapped blocks
+    if (!disk_range_valid(block, count)) {
+        return -1; // Range is outside the disk
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)block * BLOCK_SIZE;
+    size_t aligned = start - start % page_size; // msync needs a page-aligned address
+    return msync(disk_map + aligned, start + (size_t)count * BLOCK_SIZE - aligned, MS_SYNC);
+}
+
+int disk_sync(int block, int count) { // Make a range of mapped blocks durable; a no-op for the block backend
+    if (disk_map == NULL || count <= 0) {
+        return 0;
+    }
+    // Cleared before the msync, so a write racing with it marks its block again
+    pthread_mutex_lock(&map_dirty_lock);
+    for (int b = block; b < block + count && b < DISK_BLOCKS; b++) {
+        map_dirty[b] = 0;
+    }
+    pthread_mutex_unlock(&map_dirty_lock);
+    return msync_blocks(block, count);
+}
+
+int disk_sync_dirty() { // msync every run of mapped blocks written since it was last synced; a no-op for the block backend
+    if (disk_map == NULL) {
+        return 0;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&map_dirty_lock);
+    for (int block = map_dirty_first; block <= map_dirty_last; block++) {
+        if (!map_dirty[block]) {
+            continue;
+        }
+        int run = 1;
+        while (block + run <= map_dirty_last && map_dirty[block + run]) {
+            run++;
+        }
+        memset(map_dirty + block, 0, run);
+        if (msync_blocks(block, run) == -1) {
+            ret = -1; // Error flushing mapped blocks
+        }
+        block += run;
+    }
+    map_dirty_first = DISK_BLOCKS;
+    map_dirty_last = -1;
+    pthread_mutex_unlock(&map_dirty_lock);
+    return ret;
+}
+
+int disk_map_open(const char *disk_name) { // Map a disk image for FS_MOUNT_MMAP
+    struct stat st;
+    disk_map_fd = open(disk_name, O_RDWR);
+    if (disk_map_fd == -1) {
+        return -1; // Error opening disk image
+    }
+    if (fstat(disk_map_fd, &st) == -1 || st.st_size < BLOCK_SIZE) {
+        close(disk_map_fd);
+        disk_map_fd = -1;
+        return -1; // Disk image is missing or too small
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_map_fd, 0);
+    if (map == MAP_FAILED) {
+        close(disk_map_fd);
+        disk_map_fd = -1;
+        return -1; // Error mapping disk image
+    }
+    disk_map = map;
+    disk_map_size = st.st_size;
+
+    return 0; // Disk image mapped
+}
+
+int disk_map_close() { // Flush and unmap the disk image
+    int ret = disk_sync_dirty();
+    if (munmap(disk_map, disk_map_size) == -1 || close(disk_map_fd) == -1) {
+        ret = -1;
+    }
+    disk_map = NULL;
+    disk_map_size = 0;
+    disk_map_fd = -1;
+    return ret;
+}
+
+// Metadata tracking
+long long monotonic_ms() { // Milliseconds on a clock that never jumps, for the commit interval
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void mark_metadata_dirty(int region, const void *ptr, size_t len) { // Record which metadata blocks a change touched
+    struct MetadataRegion *r = &metadata_regions[region];
+    size_t start = (const char *)ptr - (const char *)r->base; // Byte position of the change inside the region
+
+    pthread_mutex_lock(&metadata_lock);
+    for (size_t block = start / BLOCK_SIZE; block <= (start + len - 1) / BLOCK_SIZE; block++) {
+        int disk_block = *r->offset + block;
+        if (!dirty_metadata[disk_block]) {
+            dirty_metadata[disk_block] = 1;
+            dirty_metadata_count++;
+        }
+    }
+    pthread_mutex_unlock(&metadata_lock);
+}
+
+void mark_inode_dirty(int index) { // Inode changed since the last commit
+    mark_metadata_dirty(INODE_REGION, &inode_table[index], sizeof(inode_table[index]));
+}
+
+void mark_directory_dirty(int index) { // Directory entry changed since the last commit
+    mark_metadata_dirty(DIRECTORY_REGION, &root_directory[index], sizeof(root_directory[index]));
+}
+
+int fault_metadata(int region, const void *ptr, size_t len) { // Read the metadata blocks a range lies in, unless already loaded
+    struct MetadataRegion *r = &metadata_regions[region];
+    size_t start = (const char *)ptr - (const char *)r->base; // Byte position of the range inside the region
+
+    for (size_t block = start / BLOCK_SIZE; block <= (start + len - 1) / BLOCK_SIZE; block++) {
+        int disk_block = *r->offset + block;
+        if (__atomic_load_n(&metadata_loaded[disk_block], __ATOMIC_ACQUIRE)) {
+            continue; // Loaded earlier; the in-memory copy may be newer than the disk
+        }
+
+        pthread_mutex_lock(&fault_lock);
+        if (!metadata_loaded[disk_block]) {
+            char block_buf[BLOCK_SIZE];
+            if (disk_read(disk_block, 1, block_buf) == -1) {
+                pthread_mutex_unlock(&fault_lock);
+                return -1; // Error reading metadata from disk
+            }
+            size_t offset = block * BLOCK_SIZE;
+            size_t copy = (r->size - offset < BLOCK_SIZE) ? r->size - offset : BLOCK_SIZE; // Last block of a region is partial
+            memcpy((char *)r->base + offset, block_buf, copy);
+            __atomic_store_n(&metadata_loaded[disk_block], 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&fault_lock);
+    }
+    return 0; // Range is in memory
+}
+
+int load_inode(int index) { // Make sure an inode is in memory before it is used
+    return fault_metadata(INODE_REGION, &inode_table[index], sizeof(inode_table[index]));
+}
+
+int load_bitmap() { // Make sure the whole bitmap is in memory before blocks are allocated or freed
+    return fault_metadata(BITMAP_REGION, bitmap, sizeof(bitmap));
+}
 
 // Helper functions
+void init_locks() { // Initialize the locks that have no static initializer
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Commit deadlines come from monotonic_ms
+    pthread_cond_init(&commit_thread_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+        pthread_mutex_init(&indirect_caches[i].lock, NULL);
+    }
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        pthread_mutex_init(&file_descriptor_table[i].lock, NULL);
+    }
+}
+
 int find_free_inode() { // Find a free inode in the inode table
+    // fs_create gives a file the inode with its directory slot's index, so the directory alone
+    // tells which inodes are free and the inode table does not have to be read in
     for (int i = 0; i < MAX_FILE_COUNT; i++) {
-        if (inode_table[i].size == 0) {
+        if (root_directory[i].inode_index == -1) {
             return i; // Return index of free inode
         }
     }
     return -1; // No free inode available
 }
 
-int find_free_file_descriptor() { // Find a free file descriptor
+int find_free_file_descriptor() { // Find and claim a free file descriptor
     for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
-        if (file_descriptor_table[i] == 0) {
-            return i; // Return index of free file descriptor
+        int expected = FD_FREE;
+        if (__atomic_compare_exchange_n(&file_descriptor_table[i].state, &expected, FD_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return i; // Return index of claimed file descriptor
         }
     }
     return -1; // No free file descriptor available
 }
 
+int block_in_use(int block) { // Check a data block's bit in the bitmap
+    return bitmap[block / 8] & (1 << (block % 8));
+}
+
+int block_reusable(int block) { // Check that a data block is free and was not freed by the uncommitted transaction
+    return !block_in_use(block) && !(pending_free[block / 8] & (1 << (block % 8)));
+}
+
+void set_block_in_use(int block, int used) { // Set or clear a data block's bit in the bitmap; caller holds allocator_lock
+    if (used) {
+        bitmap[block / 8] |= 1 << (block % 8);
+    } else {
+        bitmap[block / 8] &= ~(1 << (block % 8));
+        // Until the commit a crash brings back inodes that point here, so new data must not land in the block yet
+        pending_free[block / 8] |= 1 << (block % 8);
+        pending_free_count++;
+    }
+    mark_metadata_dirty(BITMAP_REGION, &bitmap[block / 8], 1);
+}
+
+int find_free_block() { // Find and claim a free data block
+    if (load_bitmap() == -1) {
+        return -1; // Error reading bitmap from disk
+    }
+
+    pthread_mutex_lock(&allocator_lock);
+    // Searching from just past the last allocation keeps a growing file contiguous
+    for (int n = 0; n < super_block.data_block_count; n++) {
+        int i = (free_block_hint + n) % super_block.data_block_count;
+        if (block_reusable(i)) {
+            set_block_in_use(i, 1);
+            free_block_hint = i + 1;
+            pthread_mutex_unlock(&allocator_lock);
+            return i; // Return index of the claimed block
+        }
+    }
+    if (pending_free_count > 0) {
+        // The next commit releases blocks; end_operation sees this and commits, then the writer goes on
+        __atomic_store_n(&allocation_starved, 1, __ATOMIC_RELAXED);
+        allocation_starved_here = 1;
+    }
+    pthread_mutex_unlock(&allocator_lock);
+    return -1; // No free block available
+}
+
+int fd_is_open(struct OpenFile *file) { // Check that a descriptor slot holds an open file
+    return __atomic_load_n(&file->state, __ATOMIC_ACQUIRE) == FD_OPEN;
+}
+
 int find_file(const char *name) { // Find a file by name in the root directory
     for (int i = 0; i < MAX_FILE_COUNT; i++) {
-        if (strcmp(root_directory[i].name, name) == 0) {
+        if (root_directory[i].inode_index != -1 && strcmp(root_directory[i].name, name) == 0) { // Free slots have empty names
             return i; // Return index of the file in the root directory
         }
     }
     return -1; // File not found
 }
 
+void reset_indirect_cache() { // Empty every inode's indirect block cache without writing it
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+        for (int j = 0; j < INDIRECT_CACHE_SIZE; j++) {
+            indirect_caches[i].entries[j].block = -1;
+            indirect_caches[i].entries[j].dirty = 0;
+        }
+    }
+}
+
+int write_indirect(struct IndirectBlock *entry) { // Write a cached indirect block to disk if it changed
+    if (entry->block != -1 && entry->dirty) {
+        if (disk_write(super_block.data_blocks_offset + entry->block, 1, entry->pointers) == -1) {
+            return -1; // Error writing block to disk
+        }
+        entry->dirty = 0;
+    }
+    return 0; // Block is clean
+}
+
+int flush_indirect_cache() { // Write every changed indirect block to disk; caller holds fs_lock exclusively
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+        for (int j = 0; j < INDIRECT_CACHE_SIZE; j++) {
+            if (write_indirect(&indirect_caches[i].entries[j]) == -1) {
+                return -1; // Error writing block to disk
+            }
+        }
+    }
+    return 0; // Caches are clean
+}
+
+struct IndirectBlock *load_indirect(int index, int block, int fresh) { // Get one of an inode's indirect blocks through its cache; fresh blocks start out empty
+    struct IndirectCache *cache = &indirect_caches[index];
+    struct IndirectBlock *victim = &cache->entries[0];
+    for (int i = 0; i < INDIRECT_CACHE_SIZE; i++) {
+        struct IndirectBlock *entry = &cache->entries[i];
+        if (entry->block == block) {
+            entry->last_used = ++cache->clock;
+            return entry; // Cache hit
+        }
+        if (victim->block != -1 && (entry->block == -1 || entry->last_used < victim->last_used)) {
+            victim = entry; // Prefer an empty slot, then the least recently used one
+        }
+    }
+
+    if (write_indirect(victim) == -1) {
+        return NULL; // Error writing evicted block to disk
+    }
+    victim->block = -1;
+    if (fresh) {
+        memset(victim->pointers, -1, sizeof(victim->pointers));
+        victim->dirty = 1;
+    } else if (disk_read(super_block.data_blocks_offset + block, 1, victim->pointers) == -1) {
+        return NULL; // Error reading block from disk
+    }
+    victim->block = block;
+    victim->last_used = ++cache->clock;
+
+    return victim;
+}
+
+void forget_indirect(int index, int block) { // Drop a freed indirect block from an inode's cache without writing it
+    for (int i = 0; i < INDIRECT_CACHE_SIZE; i++) {
+        struct IndirectBlock *entry = &indirect_caches[index].entries[i];
+        if (entry->block == block) {
+            entry->block = -1;
+            entry->dirty = 0;
+        }
+    }
+}
+
+int bmap_locked(int index, int file_block, int allocate) { // bmap with the inode's indirect cache lock already held
+    struct Inode *inode = &inode_table[index];
+
+    if (file_block < DIRECT_BLOCKS) {
+        if (inode->direct_blocks[file_block] == -1 && allocate) {
+            int block = find_free_block();
+            if (block == -1) {
+                return -1; // No more free blocks
+            }
+            inode->direct_blocks[file_block] = block;
+            mark_inode_dirty(index);
+        }
+        return inode->direct_blocks[file_block];
+    }
+
+    // Past the direct blocks, walk one or two levels of indirect blocks
+    int *top; // Inode field holding the first indirect block
+    int levels;
+    file_block -= DIRECT_BLOCKS;
+    if (file_block < POINTERS_PER_BLOCK) {
+        top = &inode->single_indirect;
+        levels = 1;
+    } else {
+        file_block -= POINTERS_PER_BLOCK;
+        top = &inode->double_indirect;
+        levels = 2;
+    }
+
+    int block = *top;
+    if (block == -1) {
+        if (!allocate) {
+            return -1; // Hole in the file
+        }
+        block = find_free_block();
+        if (block == -1) {
+            return -1; // No more free blocks
+        }
+        if (load_indirect(index, block, 1) == NULL) {
+            return BMAP_ERROR;
+        }
+        *top = block;
+        mark_inode_dirty(index);
+    }
+
+    for (int level = levels; level > 0; level--) {
+        int slot = (level == 2) ? file_block / POINTERS_PER_BLOCK : file_block % POINTERS_PER_BLOCK;
+        struct IndirectBlock *entry = load_indirect(index, block, 0);
+        if (entry == NULL) {
+            return BMAP_ERROR;
+        }
+
+        int next = entry->pointers[slot];
+        if (next == -1) {
+            if (!allocate) {
+                return -1; // Hole in the file
+            }
+            next = find_free_block();
+            if (next == -1) {
+                return -1; // No more free blocks
+            }
+            entry->pointers[slot] = next;
+            entry->dirty = 1;
+            if (level > 1 && load_indirect(index, next, 1) == NULL) {
+                return BMAP_ERROR;
+            }
+        }
+        block = next;
+    }
+
+    return block; // Data block holding the file block
+}
+
+int bmap(int index, int file_block, int allocate) { // Map a file block to its data block, allocating it if asked; caller holds the inode's lock
+    pthread_mutex_lock(&indirect_caches[index].lock);
+    int block = bmap_locked(index, file_block, allocate);
+    pthread_mutex_unlock(&indirect_caches[index].lock);
+    return block;
+}
+
+int free_indirect(int index, int *top, int level, int first) { // Free everything an indirect block maps from pointer range first on; caller holds the inode's indirect cache lock and allocator_lock
+    if (*top == -1) {
+        return 0; // Nothing allocated
+    }
+
+    int block = *top;
+    int span = (level == 2) ? POINTERS_PER_BLOCK : 1; // File blocks covered by one pointer
+    for (int i = first / span; i < POINTERS_PER_BLOCK; i++) {
+        // Reload every time: freeing a child goes through the cache and may evict this block
+        struct IndirectBlock *entry = load_indirect(index, block, 0);
+        if (entry == NULL) {
+            return -1; // Error reading block from disk
+        }
+        if (entry->pointers[i] == -1) {
+            continue;
+        }
+
+        if (level == 2) {
+            int child_first = (i == first / span) ? first % span : 0;
+            if (free_indirect(index, &entry->pointers[i], 1, child_first) == -1) {
+                return -1; // Error freeing child block
+            }
+        } else {
+            set_block_in_use(entry->pointers[i], 0);
+            entry->pointers[i] = -1;
+        }
+        entry->dirty = 1;
+    }
+
+    if (first == 0) {
+        forget_indirect(index, block);
+        set_block_in_use(block, 0);
+        *top = -1;
+    }
+
+    return 0; // Blocks freed
+}
+
+int free_file_blocks(int index, int first_block) { // Free every data block from file block first_block to the end
+    struct Inode *inode = &inode_table[index];
+    int ret = 0;
+
+    if (inode->flags & INODE_INLINE) {
+        return 0; // Data lives in the inode, there are no blocks to free
+    }
+    if (load_bitmap() == -1) {
+        return -1; // Error reading bitmap from disk
+    }
+
+    pthread_mutex_lock(&indirect_caches[index].lock);
+    pthread_mutex_lock(&allocator_lock);
+
+    for (int i = first_block; i < DIRECT_BLOCKS; i++) {
+        if (inode->direct_blocks[i] != -1) {
+            set_block_in_use(inode->direct_blocks[i], 0);
+            inode->direct_blocks[i] = -1;
+        }
+    }
+
+    int first = (first_block > DIRECT_BLOCKS) ? first_block - DIRECT_BLOCKS : 0;
+    if (first < POINTERS_PER_BLOCK && free_indirect(index, &inode->single_indirect, 1, first) == -1) {
+        ret = -1; // Error freeing single indirect blocks
+    }
+    first = (first_block > DIRECT_BLOCKS + POINTERS_PER_BLOCK) ? first_block - DIRECT_BLOCKS - POINTERS_PER_BLOCK : 0;
+    if (ret == 0 && free_indirect(index, &inode->double_indirect, 2, first) == -1) {
+        ret = -1; // Error freeing double indirect blocks
+    }
+
+    pthread_mutex_unlock(&allocator_lock);
+    pthread_mutex_unlock(&indirect_caches[index].lock);
+
+    mark_inode_dirty(index);
+    return ret; // Blocks freed unless ret is -1
+}
+
+int flush_write_buffer(struct OpenFile *file) { // Write a descriptor's buffered block to disk
+    if (file->wb_dirty) {
+        int block_offset = bmap(file->inode_index, file->wb_block, 0);
+        if (block_offset < 0) {
+            return -1; // Buffered block is no longer mapped
+        }
+        if (disk_write(super_block.data_blocks_offset + block_offset, 1, file->wb_buf) == -1) {
+            return -1; // Error writing block to disk
+        }
+        file->wb_dirty = 0;
+    }
+    return 0; // Buffer is clean
+}
+
+int flush_inode_buffers(int index, struct OpenFile *skip) { // Flush every write buffer holding blocks of an inode
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        struct OpenFile *file = &file_descriptor_table[i];
+        if (fd_is_open(file) && file != skip && file->inode_index == index && flush_write_buffer(file) == -1) {
+            return -1; // Error writing block to disk
+        }
+    }
+    return 0; // All buffers for the inode are clean
+}
+
+void invalidate_cached_blocks(int index, int first_block, int count, struct OpenFile *writer) { // Drop cached copies of blocks that were rewritten
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        struct OpenFile *file = &file_descriptor_table[i];
+        if (!fd_is_open(file) || file->inode_index != index) {
+            continue;
+        }
+        if (file->ra_count > 0 && first_block < file->ra_first + file->ra_count && file->ra_first < first_block + count) {
+            file->ra_count = 0;
+        }
+        if (file != writer && file->wb_block >= first_block && file->wb_block < first_block + count) {
+            file->wb_block = -1; // Other writers' buffers were flushed before this write, so just forget them
+        }
+    }
+}
+
+int fill_readahead(struct OpenFile *file, int first_block, int start) { // Prefetch a run of physically contiguous blocks in one read
+    int last_block = (inode_table[file->inode_index].size - 1) / BLOCK_SIZE; // Never prefetch past end of file
+
+    int count = 1;
+    while (count < READAHEAD_BLOCKS && first_block + count <= last_block
+           && bmap(file->inode_index, first_block + count, 0) == start + count) {
+        count++;
+    }
+
+    if (file->ra_buf == NULL) {
+        file->ra_buf = malloc(READAHEAD_BLOCKS * BLOCK_SIZE);
+        if (file->ra_buf == NULL) {
+            return -1; // Memory allocation failed
+        }
+    }
+
+    file->ra_count = 0;
+    if (disk_read(super_block.data_blocks_offset + start, count, file->ra_buf) == -1) {
+        return -1; // Error reading blocks from disk
+    }
+    file->ra_first = first_block;
+    file->ra_count = count;
+
+    return count; // Number of blocks now cached
+}
+
+int inode_has_dirty_buffers(int index) { // Check whether any descriptor holds unwritten data for an inode
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        struct OpenFile *file = &file_descriptor_table[i];
+        if (fd_is_open(file) && file->inode_index == index && file->wb_dirty) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lock_inode_for_read(int index) { // Take an inode's read lock once no descriptor holds unwritten data for it
+    pthread_rwlock_rdlock(&inode_locks[index]);
+    while (inode_has_dirty_buffers(index)) {
+        // Flushing changes other descriptors' buffers, which needs the write lock
+        pthread_rwlock_unlock(&inode_locks[index]);
+        pthread_rwlock_wrlock(&inode_locks[index]);
+        int ret = flush_inode_buffers(index, NULL);
+        pthread_rwlock_unlock(&inode_locks[index]);
+        if (ret == -1) {
+            return -1; // Error writing buffered data to disk
+        }
+        pthread_rwlock_rdlock(&inode_locks[index]);
+    }
+    return 0; // Read lock held
+}
+
+void release_open_file(struct OpenFile *file) { // Free a descriptor's buffers and mark it closed
+    free(file->ra_buf);
+    free(file->wb_buf);
+    file->ra_buf = NULL;
+    file->wb_buf = NULL;
+    __atomic_store_n(&file->state, FD_FREE, __ATOMIC_RELEASE);
+}
+
+struct OpenFile *acquire_fd(int fd) { // Start an operation on fd: takes fs_lock shared and the descriptor's lock
+    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT) {
+        return NULL; // Invalid file descriptor
+    }
+
+    pthread_rwlock_rdlock(&fs_lock);
+    struct OpenFile *file = &file_descriptor_table[fd];
+    pthread_mutex_lock(&file->lock);
+    if (!fd_is_open(file)) {
+        pthread_mutex_unlock(&file->lock);
+        pthread_rwlock_unlock(&fs_lock);
+        return NULL; // Descriptor is not open
+    }
+
+    return file;
+}
+
+void release_fd(struct OpenFile *file) { // Drop the descriptor's lock taken by acquire_fd
+    pthread_mutex_unlock(&file->lock);
+}
+
+// Metadata journal
+void copy_metadata_block(int block, char *block_buf) { // Fill block_buf with the in-memory contents of a metadata block
+    memset(block_buf, 0, BLOCK_SIZE);
+    for (int i = 0; i < METADATA_REGION_COUNT; i++) {
+        struct MetadataRegion *r = &metadata_regions[i];
+        int first = *r->offset;
+        if (block >= first && block < first + (int)BLOCKS_FOR(r->size)) {
+            size_t start = (size_t)(block - first) * BLOCK_SIZE;
+            size_t len = (r->size - start < BLOCK_SIZE) ? r->size - start : BLOCK_SIZE; // Last block of a region is partial
+            memcpy(block_buf, (char *)r->base + start, len);
+            return;
+        }
+    }
+}
+
+int read_metadata() { // Load every metadata region from disk
+    for (int i = 0; i < METADATA_REGION_COUNT; i++) {
+        struct MetadataRegion *r = &metadata_regions[i];
+        char *region_buf = malloc(BLOCKS_FOR(r->size) * BLOCK_SIZE); // Regions are not a whole number of blocks
+        if (region_buf == NULL) {
+            return -1; // Memory allocation failed
+        }
+        if (disk_read(*r->offset, BLOCKS_FOR(r->size), region_buf) == -1) {
+            free(region_buf);
+            return -1; // Error reading metadata from disk
+        }
+        memcpy(r->base, region_buf, r->size);
+        free(region_buf);
+        memset(&metadata_loaded[*r->offset], 1, BLOCKS_FOR(r->size));
+    }
+    return 0; // Metadata loaded
+}
+
+int write_metadata() { // Write every metadata region to disk, bypassing the journal
+    for (int i = 0; i < METADATA_REGION_COUNT; i++) {
+        struct MetadataRegion *r = &metadata_regions[i];
+        char *region_buf = calloc(BLOCKS_FOR(r->size), BLOCK_SIZE);
+        if (region_buf == NULL) {
+            return -1; // Memory allocation failed
+        }
+        memcpy(region_buf, r->base, r->size);
+        if (disk_write(*r->offset, BLOCKS_FOR(r->size), region_buf) == -1) {
+            free(region_buf);
+            return -1; // Error writing metadata to disk
+        }
+        free(region_buf);
+    }
+    return 0; // Metadata written
+}
+
+int write_super_block() { // Write the super block padded to a full block
+    char block_buf[BLOCK_SIZE] = {0};
+    memcpy(block_buf, &super_block, sizeof(super_block));
+    return disk_write(0, 1, block_buf);
+}
+
+int mark_disk_dirty() { // Clear the clean flag on disk; called before the first write after a clean mount
+    int ret = 0;
+    pthread_mutex_lock(&super_block_lock);
+    if (super_block.clean) {
+        // The in-memory flag stays set until the disk copy is cleared, so other writers wait here meanwhile
+        char block_buf[BLOCK_SIZE] = {0};
+        memcpy(block_buf, &super_block, sizeof(super_block));
+        ((struct SuperBlock *)block_buf)->clean = 0;
+        ret = (disk_write(0, 1, block_buf) == -1 || disk_sync(0, 1) == -1) ? -1 : 0;
+        if (ret == 0) {
+            __atomic_store_n(&super_block.clean, 0, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&super_block_lock);
+    return ret;
+}
+
+int write_journal_header(const struct JournalHeader *header) { // Write the journal header; this is the commit point
+    char block_buf[BLOCK_SIZE] = {0};
+    memcpy(block_buf, header, sizeof(*header));
+    return disk_write(super_block.journal_offset, 1, block_buf);
+}
+
+unsigned int journal_checksum(const char *data, size_t len) { // FNV-1a hash of the logged blocks
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int write_home_blocks(const int *targets, int count, const char *log) { // Checkpoint logged blocks to their home locations
+    for (int i = 0; i < count;) {
+        int run = 1; // Neighbouring blocks are written with one request
+        while (i + run < count && targets[i + run] == targets[i] + run) {
+            run++;
+        }
+        if (disk_write(targets[i], run, log + (size_t)i * BLOCK_SIZE) == -1 || disk_sync(targets[i], run) == -1) {
+            return -1; // Error writing metadata to disk
+        }
+        i += run;
+    }
+    return 0; // Checkpoint complete
+}
+
+int commit_transaction() { // Log every dirty metadata block, commit, then checkpoint; caller holds fs_lock exclusively
+    // Data goes to disk before the metadata that points at it
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        if (fd_is_open(&file_descriptor_table[i]) && flush_write_buffer(&file_descriptor_table[i]) == -1) {
+            return -1; // Error writing buffered data to disk
+        }
+    }
+
+    if (flush_indirect_cache() == -1) {
+        return -1; // Error writing indirect blocks to disk
+    }
+    if (disk_sync_dirty() == -1) {
+        return -1; // Error flushing mapped data to disk
+    }
+
+    last_commit_ms = monotonic_ms();
+    if (dirty_metadata_count == 0) {
+        return 0; // Nothing to commit
+    }
+
+    char *log = malloc(JOURNAL_CAPACITY * BLOCK_SIZE); // Images of the blocks being logged
+    if (log == NULL) {
+        return -1; // Memory allocation failed
+    }
+
+    // Dirty blocks are logged in disk order, a journal-full of blocks at a time
+    int block = 0;
+    while (block < (int)METADATA_BLOCKS) {
+        struct JournalHeader header;
+        memset(&header, 0, sizeof(header));
+
+        for (; block < (int)METADATA_BLOCKS && header.count < JOURNAL_CAPACITY; block++) {
+            if (dirty_metadata[block]) {
+                copy_metadata_block(block, log + (size_t)header.count * BLOCK_SIZE);
+                header.target_blocks[header.count++] = block;
+            }
+        }
+        if (header.count == 0) {
+            break; // No more dirty blocks
+        }
+
+        header.magic = JOURNAL_MAGIC;
+        header.sequence = journal_sequence + 1;
+        header.checksum = journal_checksum(log, (size_t)header.count * BLOCK_SIZE);
+
+        if (disk_write(super_block.journal_offset + 1, header.count, log) == -1
+            || disk_sync(super_block.journal_offset + 1, header.count) == -1
+            || write_journal_header(&header) == -1
+            || disk_sync(super_block.journal_offset, 1) == -1
+            || write_home_blocks(header.target_blocks, header.count, log) == -1) {
+            free(log);
+            return -1; // Error writing journal or metadata to disk
+        }
+        journal_sequence = header.sequence;
+    }
+
+    memset(dirty_metadata, 0, sizeof(dirty_metadata));
+    dirty_metadata_count = 0;
+    memset(pending_free, 0, sizeof(pending_free)); // The checkpointed metadata no longer points at blocks freed before it
+    pending_free_count = 0;
+    __atomic_store_n(&allocation_starved, 0, __ATOMIC_RELAXED);
+    free(log);
+
+    return 0; // Transaction committed
+}
+
+int replay_journal() { // Redo the last committed transaction in case its checkpoint was interrupted
+    char block_buf[BLOCK_SIZE];
+    struct JournalHeader header;
+
+    if (disk_read(super_block.journal_offset, 1, block_buf) == -1) {
+        return -1; // Error reading journal header
+    }
+    memcpy(&header, block_buf, sizeof(header));
+
+    if (header.magic != JOURNAL_MAGIC) {
+        return -1; // Journal is corrupt
+    }
+    journal_sequence = header.sequence;
+    if (header.count <= 0 || header.count > JOURNAL_CAPACITY) {
+        return 0; // Nothing to replay
+    }
+
+    char *log = malloc((size_t)header.count * BLOCK_SIZE);
+    if (log == NULL) {
+        return -1; // Memory allocation failed
+    }
+    if (disk_read(super_block.journal_offset + 1, header.count, log) == -1) {
+        free(log);
+        return -1; // Error reading journal
+    }
+
+    // A checksum mismatch means the crash hit while a newer transaction was being logged,
+    // after the previous one had already been checkpointed, so there is nothing to redo
+    int ret = 0;
+    if (journal_checksum(log, (size_t)header.count * BLOCK_SIZE) == header.checksum) {
+        ret = write_home_blocks(header.target_blocks, header.count, log);
+    }
+    free(log);
+
+    return ret;
+}
+
+// Consistency check
+int claim_blocks(unsigned char *reached, int *pointer, int level) { // Mark a block and everything it maps as reached; returns 1 if *pointer had to be dropped
+    int block = *pointer;
+    if (block == -1) {
+        return 0; // Nothing allocated
+    }
+    if (block < 0 || block >= super_block.data_block_count || (reached[block / 8] & (1 << (block % 8)))) {
+        *pointer = -1; // Out of range, or already owned by another pointer
+        return 1;
+    }
+    reached[block / 8] |= 1 << (block % 8);
+    if (level == 0) {
+        return 0; // Data block
+    }
+
+    int pointers[POINTERS_PER_BLOCK];
+    if (disk_read(super_block.data_blocks_offset + block, 1, pointers) == -1) {
+        return -1; // Error reading indirect block
+    }
+    int changed = 0;
+    for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+        int ret = claim_blocks(reached, &pointers[i], level - 1);
+        if (ret == -1) {
+            return -1; // Error reading a child block
+        }
+        changed |= ret;
+    }
+    if (changed && disk_write(super_block.data_blocks_offset + block, 1, pointers) == -1) {
+        return -1; // Error writing repaired indirect block
+    }
+    return 0; // Block and its children reached
+}
+
+int check_consistency() { // Rebuild the bitmap from the blocks inodes reach; run when the disk was not unmounted cleanly
+    unsigned char *reached = calloc(1, sizeof(bitmap));
+    if (reached == NULL) {
+        return -1; // Memory allocation failed
+    }
+
+    // Indirect blocks written back before a crash can point at blocks the committed bitmap calls free
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+        struct Inode *inode = &inode_table[i];
+        if (!inode->in_use || (inode->flags & INODE_INLINE)) {
+            continue; // No blocks to account for
+        }
+        int changed = 0, ret = 0;
+        for (int j = 0; j < DIRECT_BLOCKS && ret != -1; j++) {
+            ret = claim_blocks(reached, &inode->direct_blocks[j], 0);
+            changed |= ret;
+        }
+        if (ret != -1) {
+            ret = claim_blocks(reached, &inode->single_indirect, 1);
+            changed |= ret;
+        }
+        if (ret != -1) {
+            ret = claim_blocks(reached, &inode->double_indirect, 2);
+            changed |= ret;
+        }
+        if (ret == -1) {
+            free(reached);
+            return -1; // Error reading indirect blocks
+        }
+        if (changed) {
+            mark_inode_dirty(i);
+        }
+    }
+
+    if (memcmp(reached, bitmap, sizeof(bitmap)) != 0) {
+        memcpy(bitmap, reached, sizeof(bitmap));
+        mark_metadata_dirty(BITMAP_REGION, bitmap, sizeof(bitmap));
+    }
+    free(reached);
+
+    return 0; // Bitmap matches the inodes
+}
+
+int leave_operation(int ret) { // Finish an operation that changed no metadata
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+int commit_due() { // Check whether metadata has been dirty long enough to commit, or an allocation waits for one; caller holds metadata_lock or fs_lock exclusively
+    // The whole metadata area fits in one journal write, so the only trigger is time: every operation in an interval
+    // shares a commit, and a run of appends does not have its partly filled write buffers flushed every few calls
+    return __atomic_load_n(&allocation_starved, __ATOMIC_RELAXED)
+        || (dirty_metadata_count > 0 && monotonic_ms() - last_commit_ms >= COMMIT_INTERVAL_MS);
+}
+
+int end_operation(int ret) { // Finish a metadata-changing operation, committing once enough has been batched
+    int due = 0;
+    pthread_mutex_lock(&metadata_lock);
+    if ((ret >= 0 || allocation_starved_here) && commit_due()) {
+        due = 1;
+    }
+    pthread_mutex_unlock(&metadata_lock);
+    pthread_rwlock_unlock(&fs_lock);
+
+    if (due) {
+        pthread_rwlock_wrlock(&fs_lock);
+        // Another thread may have committed while this one waited for the lock
+        if (commit_due() && commit_transaction() == -1) {
+            ret = -1; // Error committing metadata
+        }
+        pthread_rwlock_unlock(&fs_lock);
+    }
+
+    return ret;
+}
+
+void *commit_worker(void *unused) { // Commit metadata once it has been dirty for COMMIT_INTERVAL_MS, even if the file system has gone idle
+    (void)unused;
+    pthread_mutex_lock(&commit_thread_lock);
+    while (commit_thread_running) {
+        pthread_mutex_unlock(&commit_thread_lock);
+
+        pthread_rwlock_rdlock(&fs_lock);
+        pthread_mutex_lock(&metadata_lock);
+        int due = commit_due();
+        long long deadline = (dirty_metadata_count > 0 ? last_commit_ms : monotonic_ms()) + COMMIT_INTERVAL_MS;
+        pthread_mutex_unlock(&metadata_lock);
+        pthread_rwlock_unlock(&fs_lock);
+
+        if (due) {
+            pthread_rwlock_wrlock(&fs_lock);
+            if (commit_due()) {
+                commit_transaction(); // On failure the metadata stays dirty for the next try, fs_sync or umount_fs
+            }
+            deadline = monotonic_ms() + COMMIT_INTERVAL_MS;
+            pthread_rwlock_unlock(&fs_lock);
+        }
+
+        struct timespec ts = {deadline / 1000, deadline % 1000 * 1000000};
+        pthread_mutex_lock(&commit_thread_lock);
+        if (commit_thread_running) {
+            pthread_cond_timedwait(&commit_thread_cond, &commit_thread_lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&commit_thread_lock);
+    return NULL;
+}
+
+int start_commit_thread() { // Start the background commits for a mounted file system
+    commit_thread_running = 1;
+    if (pthread_create(&commit_thread, NULL, commit_worker, NULL) != 0) {
+        commit_thread_running = 0;
+        return -1; // Error creating thread
+    }
+    return 0;
+}
+
+void stop_commit_thread() { // Stop the background commits; umount_fs commits what is left
+    pthread_mutex_lock(&commit_thread_lock);
+    int running = commit_thread_running;
+    commit_thread_running = 0;
+    pthread_cond_signal(&commit_thread_cond);
+    pthread_mutex_unlock(&commit_thread_lock);
+    if (running) {
+        pthread_join(commit_thread, NULL);
+    }
+}
+
+// Asynchronous I/O shutdown
+void async_shutdown() { // Wait for every outstanding request, then stop the worker threads
+    pthread_mutex_lock(&async_lock);
+    while (async_in_flight > 0) {
+        pthread_cond_wait(&async_done_cond, &async_lock);
+    }
+    int running = async_running;
+    async_running = 0;
+    pthread_cond_broadcast(&async_queue_cond);
+    pthread_mutex_unlock(&async_lock);
+
+    if (running) {
+        for (int i = 0; i < ASYNC_WORKER_COUNT; i++) {
+            pthread_join(async_workers[i], NULL);
+        }
+    }
+}
+
 // Management Routines
 
 int make_fs(const char *disk_name) { // Create a file system on disk
@@ -73,238 +1279,671 @@ int make_fs(const char *disk_name) { // Create a file system on disk
         return -1; // Error opening disk
     }
 
+    pthread_once(&locks_once, init_locks);
+
     // Initialize super block, inode table, bitmap, and root directory
-    super_block.inode_table_offset = 1;
-    super_block.data_blocks_offset = MAX_FILE_COUNT + 1;
-    super_block.bitmap_offset = super_block.data_blocks_offset + 256;
-    super_block.root_directory_offset = super_block.bitmap_offset + 256;
+    super_block.magic = FS_MAGIC;
+    super_block.journal_offset = 1;
+    super_block.journal_blocks = JOURNAL_BLOCKS;
+    super_block.inode_table_offset = super_block.journal_offset + JOURNAL_BLOCKS;
+    super_block.bitmap_offset = super_block.inode_table_offset + INODE_TABLE_BLOCKS;
+    super_block.root_directory_offset = super_block.bitmap_offset + BITMAP_BLOCKS;
+    super_block.data_blocks_offset = super_block.root_directory_offset + DIRECTORY_BLOCKS;
+    super_block.data_block_count = DISK_BLOCKS - super_block.data_blocks_offset;
+    super_block.clean = 0; // Set once everything else is on disk
+    super_block.journal_sequence = 0;
 
     for (int i = 0; i < MAX_FILE_COUNT; i++) {
+        inode_table[i].in_use = 0;
         inode_table[i].size = 0;
-        memset(inode_table[i].data_block_offsets, -1, sizeof(inode_table[i].data_block_offsets));
+        inode_table[i].flags = 0;
+        memset(inode_table[i].direct_blocks, -1, sizeof(inode_table[i].direct_blocks));
+        inode_table[i].single_indirect = -1;
+        inode_table[i].double_indirect = -1;
         memset(root_directory[i].name, 0, sizeof(root_directory[i].name));
         root_directory[i].inode_index = -1;
     }
 
     memset(bitmap, 0, sizeof(bitmap));
-
-    // Write super block, inode table, bitmap, and root directory to disk
-    if (write_blocks(0, 1, &super_block) == -1) {
-        return -1; // Error writing super block to disk
-    }
-    if (write_blocks(super_block.inode_table_offset, MAX_FILE_COUNT, inode_table) == -1) {
-        return -1; // Error writing inode table to disk
+    memset(pending_free, 0, sizeof(pending_free));
+    pending_free_count = 0;
+    reset_indirect_cache();
+    free_block_hint = 0;
+
+    // Write metadata tables, an empty journal, and finally the super block to disk
+    struct JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+
+    if (write_metadata() == -1) {
+        return -1; // Error writing inode table, bitmap, or root directory to disk
     }
-    if (write_blocks(super_block.bitmap_offset, 1, bitmap) == -1) {
-        return -1; // Error writing bitmap to disk
+    if (write_journal_header(&header) == -1) {
+        return -1; // Error writing journal to disk
     }
-    if (write_blocks(super_block.root_directory_offset, MAX_FILE_COUNT, root_directory) == -1) {
-        return -1; // Error writing root directory to disk
+    super_block.clean = 1;
+    if (write_super_block() == -1) {
+        return -1; // Error writing super block to disk
     }
 
     if (close_disk(disk_name) == -1) {
         return -1; // Error closing disk
     }
 
-    return 0; // File system creation successful
+    return 0; // File system creation successful
+}
+
+int close_backend(const char *disk_name) { // Close the disk through whichever backend opened it
+    if (disk_map != NULL) {
+        return disk_map_close();
+    }
+    return close_disk(disk_name);
+}
+
+int abandon_mount(const char *disk_name) { // Close the disk after a failed mount so it can be opened again
+    close_backend(disk_name);
+    return -1;
 }
 
-int mount_fs(const char *disk_name) { // Mount an existing file system from disk
-    if (open_disk(disk_name) == -1) {
+int mount_fs_options(const char *disk_name, int options) { // Mount an existing file system with FS_MOUNT_* options
+    pthread_once(&locks_once, init_locks);
+
+    if (options & FS_MOUNT_MMAP) {
+        if (disk_map_open(disk_name) == -1) {
+            return -1; // Error mapping disk
+        }
+    } else if (open_disk(disk_name) == -1) {
         return -1; // Error opening disk
     }
 
-    // Read super block, inode table, bitmap, and root directory from disk
-    if (read_blocks(0, 1, &super_block) == -1) {
-        return -1; // Error reading super block from disk
+    // Read the super block; everything else is read in on first use unless the disk needs recovery
+    char block_buf[BLOCK_SIZE];
+    if (disk_read(0, 1, block_buf) == -1) {
+        return abandon_mount(disk_name); // Error reading super block from disk
     }
-    if (read_blocks(super_block.inode_table_offset, MAX_FILE_COUNT, inode_table) == -1) {
-        return -1; // Error reading inode table from disk
+    memcpy(&super_block, block_buf, sizeof(super_block));
+    if (super_block.magic != FS_MAGIC) {
+        return abandon_mount(disk_name); // Disk does not hold a file system
     }
-    if (read_blocks(super_block.bitmap_offset, 1, bitmap) == -1) {
-        return -1; // Error reading bitmap from disk
+
+    memset(metadata_loaded, 0, sizeof(metadata_loaded));
+    memset(dirty_metadata, 0, sizeof(dirty_metadata));
+    dirty_metadata_count = 0;
+    last_commit_ms = monotonic_ms();
+    reset_indirect_cache();
+
+    if (super_block.clean) {
+        // The journal was checkpointed and the bitmap matches the inodes, so only the directory is needed now
+        journal_sequence = super_block.journal_sequence;
+        if (fault_metadata(DIRECTORY_REGION, root_directory, sizeof(root_directory)) == -1) {
+            return abandon_mount(disk_name); // Error reading root directory from disk
+        }
+    } else {
+        if (replay_journal() == -1) {
+            return abandon_mount(disk_name); // Error recovering metadata from the journal
+        }
+        if (read_metadata() == -1) {
+            return abandon_mount(disk_name); // Error reading inode table, bitmap, or root directory from disk
+        }
+        if (check_consistency() == -1) {
+            return abandon_mount(disk_name); // Error checking the file system
+        }
+    }
+
+    memset(pending_free, 0, sizeof(pending_free));
+    pending_free_count = 0;
+    allocation_starved = 0;
+    free_block_hint = 0;
+    // No files are open after a mount
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        if (file_descriptor_table[i].state != FD_FREE) {
+            release_open_file(&file_descriptor_table[i]);
+        }
     }
-    if (read_blocks(super_block.root_directory_offset, MAX_FILE_COUNT, root_directory) == -1) {
-        return -1; // Error reading root directory from disk
+
+    if (start_commit_thread() == -1) {
+        return abandon_mount(disk_name); // Error starting the background commits
     }
 
     return 0; // File system mounting successful
 }
 
+int mount_fs(const char *disk_name) { // Mount an existing file system from disk
+    return mount_fs_options(disk_name, 0);
+}
+
 int umount_fs(const char *disk_name) { // Unmount the file system and write changes to disk
-    // Write super block, inode table, bitmap, and root directory to disk
-    if (write_blocks(0, 1, &super_block) == -1) {
-        return -1; // Error writing super block to disk
-    }
-    if (write_blocks(super_block.inode_table_offset, MAX_FILE_COUNT, inode_table) == -1) {
-        return -1; // Error writing inode table to disk
+    async_shutdown(); // Requests still in flight finish against the mounted file system
+    stop_commit_thread();
+
+    pthread_rwlock_wrlock(&fs_lock);
+
+    // Commit outstanding metadata; this also flushes buffered writes
+    if (commit_transaction() == -1) {
+        pthread_rwlock_unlock(&fs_lock);
+        return -1; // Error writing changes to disk
     }
-    if (write_blocks(super_block.bitmap_offset, 1, bitmap) == -1) {
-        return -1; // Error writing bitmap to disk
+
+    // Release every descriptor still open
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        if (file_descriptor_table[i].state != FD_FREE) {
+            release_open_file(&file_descriptor_table[i]);
+        }
     }
-    if (write_blocks(super_block.root_directory_offset, MAX_FILE_COUNT, root_directory) == -1) {
-        return -1; // Error writing root directory to disk
+
+    // Everything is on disk, so the next mount can skip recovery
+    if (!super_block.clean) {
+        super_block.clean = 1;
+        super_block.journal_sequence = journal_sequence;
+        if (write_super_block() == -1 || disk_sync(0, 1) == -1) {
+            pthread_rwlock_unlock(&fs_lock);
+            return -1; // Error writing super block to disk
+        }
     }
 
-    if (close_disk(disk_name) == -1) {
-        return -1; // Error closing disk
+    pthread_rwlock_unlock(&fs_lock);
+
+    if (close_backend(disk_name) == -1) {
+        return -1; // Error closing or unmapping disk
     }
 
     return 0; // File system unmounting successful
 }
 
+int fs_sync() { // Commit all outstanding changes to disk
+    pthread_rwlock_wrlock(&fs_lock);
+    int ret = commit_transaction();
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
 // File System Functions
 
-int fs_open(const char *name) { // Open a file
-    int fd = find_free_file_descriptor();
-    if (fd == -1) {
-        return -1; // No free file descriptor
+int fs_open_flags(const char *name, int flags) { // Open a file with the given open flags
+    if (name[0] == '\0') {
+        return -1; // No file has an empty name
     }
 
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&directory_lock);
+
     int index = find_file(name);
     if (index == -1) {
-        return -1; // File not found
+        pthread_rwlock_unlock(&directory_lock);
+        return leave_operation(-1); // File not found
+    }
+
+    if (load_inode(root_directory[index].inode_index) == -1) {
+        pthread_rwlock_unlock(&directory_lock);
+        return leave_operation(-1); // Error reading inode from disk
     }
 
-    file_descriptor_table[fd] = index;
-    return fd; // Return file descriptor
+    int fd = find_free_file_descriptor();
+    if (fd == -1) {
+        pthread_rwlock_unlock(&directory_lock);
+        return leave_operation(-1); // No free file descriptor
+    }
+
+    // The slot is claimed, so nobody else touches it until it is published as open
+    struct OpenFile *file = &file_descriptor_table[fd];
+    file->inode_index = root_directory[index].inode_index;
+    file->offset = 0; // Every new descriptor starts at the beginning of the file
+    file->flags = flags;
+    file->next_block = 0;
+    file->ra_count = 0;
+    file->wb_block = -1;
+    file->wb_dirty = 0;
+    __atomic_store_n(&file->state, FD_OPEN, __ATOMIC_RELEASE);
+
+    pthread_rwlock_unlock(&directory_lock);
+    return leave_operation(fd); // Return file descriptor
+}
+
+int fs_open(const char *name) { // Open a file
+    return fs_open_flags(name, 0);
 }
 
 int fs_close(int fd) { // Close a file
-    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT || file_descriptor_table[fd] == 0) {
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
         return -1; // Invalid file descriptor
     }
 
-    file_descriptor_table[fd] = 0;
-    return 0; // File closed successfully
+    int index = file->inode_index;
+    pthread_rwlock_wrlock(&inode_locks[index]);
+    int ret = flush_write_buffer(file); // Error writing buffered data to disk if -1
+    if (ret == 0) {
+        release_open_file(file);
+    }
+    pthread_rwlock_unlock(&inode_locks[index]);
+
+    release_fd(file);
+    return leave_operation(ret); // File closed unless ret is -1
 }
 
 int fs_create(const char *name) { // Create a new file
+    if (strlen(name) > MAX_FILE_NAME_LENGTH) {
+        return -1; // File name too long
+    }
+    if (name[0] == '\0') {
+        return -1; // An empty name would look like a free directory slot
+    }
+
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(&directory_lock);
+
     int index = find_file(name);
     if (index != -1) {
-        return -1; // File already exists
+        pthread_rwlock_unlock(&directory_lock);
+        return end_operation(-1); // File already exists
     }
 
     index = find_free_inode();
     if (index == -1) {
-        return -1; // No free inode
+        pthread_rwlock_unlock(&directory_lock);
+        return end_operation(-1); // No free inode
     }
-
-    if (strlen(name) > MAX_FILE_NAME_LENGTH) {
-        return -1; // File name too long
+    if (load_inode(index) == -1) {
+        pthread_rwlock_unlock(&directory_lock);
+        return end_operation(-1); // Error reading inode from disk
     }
 
     strcpy(root_directory[index].name, name);
     root_directory[index].inode_index = index;
+    inode_table[index].in_use = 1;
     inode_table[index].size = 0;
+    inode_table[index].flags = INODE_INLINE; // Files start out inline and move to data blocks once they outgrow the inode
+    memset(inode_table[index].inline_data, 0, sizeof(inode_table[index].inline_data));
+    mark_directory_dirty(index);
+    mark_inode_dirty(index);
 
-    return 0; // File created successfully
+    pthread_rwlock_unlock(&directory_lock);
+    return end_operation(0); // File created once the operation is logged
 }
 
 int fs_delete(const char *name) { // Delete a file
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(&directory_lock);
+
     int index = find_file(name);
     if (index == -1) {
-        return -1; // File not found
+        pthread_rwlock_unlock(&directory_lock);
+        return end_operation(-1); // File not found
+    }
+    int inode_index = root_directory[index].inode_index;
+    if (load_inode(inode_index) == -1) {
+        pthread_rwlock_unlock(&directory_lock);
+        return end_operation(-1); // Error reading inode from disk
     }
 
-    // Check if the file is open
+    // Check if the file is open; holding the directory lock keeps fs_open out
     for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
-        if (file_descriptor_table[i] == index) {
-            return -1; // File is open
+        if (fd_is_open(&file_descriptor_table[i]) && file_descriptor_table[i].inode_index == inode_index) {
+            pthread_rwlock_unlock(&directory_lock);
+            return end_operation(-1); // File is open
         }
     }
 
     // Free data blocks and inode
-    for (int i = 0; i < 256; i++) {
-        if (inode_table[index].data_block_offsets[i] != -1) {
-            bitmap[inode_table[index].data_block_offsets[i]] = 0;
-            inode_table[index].data_block_offsets[i] = -1;
-        }
+    pthread_rwlock_wrlock(&inode_locks[inode_index]);
+    if (free_file_blocks(inode_index, 0) == -1) {
+        pthread_rwlock_unlock(&inode_locks[inode_index]);
+        pthread_rwlock_unlock(&directory_lock);
+        return end_operation(-1); // Error freeing data blocks
     }
-    inode_table[index].size = 0;
+    inode_table[inode_index].size = 0;
+    inode_table[inode_index].in_use = 0;
+    mark_inode_dirty(inode_index);
+    pthread_rwlock_unlock(&inode_locks[inode_index]);
 
     memset(root_directory[index].name, 0, sizeof(root_directory[index].name));
     root_directory[index].inode_index = -1;
+    mark_directory_dirty(index);
 
-    return 0; // File deleted successfully
+    pthread_rwlock_unlock(&directory_lock);
+    return end_operation(0); // File deleted once the operation is logged
 }
 
-int fs_read(int fd, void *buf, size_t nbyte) { // Read from a file
-    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT || file_descriptor_table[fd] == 0) {
-        return -1; // Invalid file descriptor
+int read_at(struct OpenFile *file, void *buf, size_t nbyte, off_t offset) { // Read up to nbyte bytes of an open file starting at offset; caller holds lock_inode_for_read
+    int index = file->inode_index;
+
+    long long size = inode_table[index].size;
+    if (offset >= size) {
+        return 0; // Nothing to read at or past end of file
+    }
+    if (nbyte > (size_t)(size - offset)) {
+        nbyte = size - offset; // Never read past end of file
+    }
+    if (nbyte > MAX_IO_SIZE) {
+        nbyte = MAX_IO_SIZE; // Files can be larger than an int counts; the caller reads the rest with another call
     }
 
-    int index = file_descriptor_table[fd];
-    int size = inode_table[index].size;
-    int bytes_to_read = (size < nbyte) ? size : nbyte;
+    if (inode_table[index].flags & INODE_INLINE) {
+        memcpy(buf, inode_table[index].inline_data + offset, nbyte);
+        return nbyte; // Small files are read straight out of the inode
+    }
 
+    char block_buf[BLOCK_SIZE]; // Holds a block that is only partially copied out
     int bytes_read = 0; // Total bytes read
-    int remaining_bytes = bytes_to_read; // Remaining bytes to read
-    int current_block = 0; // Current block index
 
-    // Read data blocks from disk
-    while (remaining_bytes > 0 && current_block < 256) {
-        int block_offset = inode_table[index].data_block_offsets[current_block];
-        if (block_offset == -1) {
-            break; // No more blocks to read
+    // Only the blocks that overlap [offset, offset + nbyte) are touched
+    while (bytes_read < (int)nbyte) {
+        int current_block = (offset + bytes_read) / BLOCK_SIZE; // Block holding the next byte
+        int block_pos = (offset + bytes_read) % BLOCK_SIZE; // Position of the next byte inside that block
+        int bytes_in_block = BLOCK_SIZE - block_pos; // Bytes to copy from current block
+        if (bytes_in_block > (int)nbyte - bytes_read) {
+            bytes_in_block = nbyte - bytes_read;
         }
-        
-        int bytes_in_block = (remaining_bytes < 4096) ? remaining_bytes : 4096; // Bytes to read from current block
-        char temp_buf[bytes_in_block]; // Temporary buffer to hold block data
-        
-        if (read_blocks(super_block.data_blocks_offset + block_offset, 1, temp_buf) == -1) {
-            return -1; // Error reading block from disk
+
+        int block_offset = bmap(index, current_block, 0);
+        if (block_offset == BMAP_ERROR) {
+            return -1; // Error reading block map from disk
+        }
+        int cached = file->ra_count > 0 && current_block >= file->ra_first && current_block < file->ra_first + file->ra_count;
+        if (block_offset != -1 && disk_map == NULL && !cached && current_block == file->next_block) {
+            // Sequential access: pull in this block and the ones after it with a single read
+            if (fill_readahead(file, current_block, block_offset) == -1) {
+                return -1; // Error reading blocks from disk
+            }
+            cached = 1;
         }
-        
-        memcpy(buf + bytes_read, temp_buf, bytes_in_block); // Copy block data to output buffer
+
+        if (block_offset == -1) {
+            memset((char *)buf + bytes_read, 0, bytes_in_block); // Unallocated block inside the file reads as zeros
+        } else if (disk_map != NULL) {
+            // Mapped disk: copy straight out of the mapping, no readahead or bounce buffer needed
+            int disk_block = super_block.data_blocks_offset + block_offset;
+            if (!disk_range_valid(disk_block, 1)) {
+                return -1; // Block is outside the disk
+            }
+            count_disk_read(1); // Bypasses disk_read, but is still a block read for the statistics
+            memcpy((char *)buf + bytes_read, disk_map + (size_t)disk_block * BLOCK_SIZE + block_pos, bytes_in_block);
+        } else if (cached) {
+            memcpy((char *)buf + bytes_read, file->ra_buf + (current_block - file->ra_first) * BLOCK_SIZE + block_pos, bytes_in_block);
+        } else if (bytes_in_block == BLOCK_SIZE) {
+            if (disk_read(super_block.data_blocks_offset + block_offset, 1, (char *)buf + bytes_read) == -1) {
+                return -1; // Error reading block from disk
+            }
+        } else {
+            if (disk_read(super_block.data_blocks_offset + block_offset, 1, block_buf) == -1) {
+                return -1; // Error reading block from disk
+            }
+            memcpy((char *)buf + bytes_read, block_buf + block_pos, bytes_in_block); // Copy the requested part of the block
+        }
+
         bytes_read += bytes_in_block; // Update total bytes read
-        remaining_bytes -= bytes_in_block; // Update remaining bytes
-        current_block++; // Move to next block
     }
 
+    file->next_block = (offset + bytes_read) / BLOCK_SIZE; // Block a sequential reader asks for next
+
     return bytes_read; // Return total bytes read
 }
 
-int fs_write(int fd, const void *buf, size_t nbyte) { // Write to a file
-    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT || file_descriptor_table[fd] == 0) {
-        return -1; // Invalid file descriptor
+int spill_inline_data(int index) { // Move an inline file's contents into a data block so it can grow past INLINE_DATA_SIZE
+    struct Inode *inode = &inode_table[index];
+    char block_buf[BLOCK_SIZE] = {0};
+    memcpy(block_buf, inode->inline_data, inode->size);
+
+    inode->flags &= ~INODE_INLINE;
+    memset(inode->direct_blocks, -1, sizeof(inode->direct_blocks));
+    inode->single_indirect = -1;
+    inode->double_indirect = -1;
+    mark_inode_dirty(index);
+    if (inode->size == 0) {
+        return 0; // Nothing to move
+    }
+
+    int block = bmap(index, 0, 1);
+    if (block >= 0 && disk_write(super_block.data_blocks_offset + block, 1, block_buf) == 0) {
+        return 0; // Contents now live in the file's first block
+    }
+
+    // Put the file back the way it was
+    if (block >= 0) {
+        free_file_blocks(index, 0);
+    }
+    inode->flags |= INODE_INLINE;
+    memcpy(inode->inline_data, block_buf, sizeof(inode->inline_data));
+    return -1; // No free block, or error writing it
+}
+
+int write_at(struct OpenFile *file, const void *buf, size_t nbyte, off_t offset) { // Write nbyte bytes to an open file starting at offset; caller holds the inode's write lock
+    int index = file->inode_index;
+    if (offset >= MAX_FILE_SIZE) {
+        return 0; // File is already at its maximum size
+    }
+    if (nbyte > (size_t)(MAX_FILE_SIZE - offset)) {
+        nbyte = MAX_FILE_SIZE - offset; // Never grow past the maximum file size
+    }
+    if (nbyte > MAX_IO_SIZE) {
+        nbyte = MAX_IO_SIZE; // A short write, like write(2), rather than a count that wraps
+    }
+
+    struct Inode *inode = &inode_table[index];
+    if (inode->flags & INODE_INLINE) {
+        if (offset + nbyte <= INLINE_DATA_SIZE) {
+            memcpy(inode->inline_data + offset, buf, nbyte);
+            if (inode->size < offset + (off_t)nbyte) {
+                inode->size = offset + nbyte;
+            }
+            mark_inode_dirty(index);
+            return nbyte; // Written into the inode
+        }
+        if (spill_inline_data(index) == -1) {
+            return -1; // Error moving the file to data blocks
+        }
     }
 
-    int index = file_descriptor_table[fd];
+    if (flush_inode_buffers(index, file) == -1) {
+        return -1; // Other descriptors' buffered blocks must not overwrite this write later
+    }
 
     int bytes_written = 0; // Total bytes written
-    int remaining_bytes = nbyte; // Remaining bytes to write
-    int current_block = 0; // Current block index
 
-    // Write data blocks to disk
-    while (remaining_bytes > 0 && current_block < 256) {
-        int block_offset = inode_table[index].data_block_offsets[current_block];
+    // Only the blocks that overlap [offset, offset + nbyte) are touched
+    while (bytes_written < (int)nbyte) {
+        int current_block = (offset + bytes_written) / BLOCK_SIZE; // Block holding the next byte
+        int block_pos = (offset + bytes_written) % BLOCK_SIZE; // Position of the next byte inside that block
+        int bytes_in_block = BLOCK_SIZE - block_pos; // Bytes to write to current block
+        if (bytes_in_block > (int)nbyte - bytes_written) {
+            bytes_in_block = nbyte - bytes_written;
+        }
+
+        int block_offset = bmap(index, current_block, 0);
+        int new_block = 0; // Set if the block has no previous contents
         if (block_offset == -1) {
-            block_offset = find_free_block();
+            block_offset = bmap(index, current_block, 1);
             if (block_offset == -1) {
                 break; // No more free blocks
             }
-            inode_table[index].data_block_offsets[current_block] = block_offset;
+            new_block = 1;
+        }
+        if (block_offset == BMAP_ERROR) {
+            return -1; // Error reading block map from disk
         }
 
-        int bytes_in_block = (remaining_bytes < 4096) ? remaining_bytes : 4096; // Bytes to write to current block
-        if (write_blocks(super_block.data_blocks_offset + block_offset, 1, (char *)buf + bytes_written) == -1) {
-            return -1; // Error writing block to disk
+        const char *src = (const char *)buf + bytes_written;
+        if (bytes_in_block < BLOCK_SIZE) {
+            // Partial block: gather it in the write buffer so small writes become one block write
+            if (file->wb_buf == NULL || file->wb_block != current_block) {
+                if (file->wb_buf != NULL && flush_write_buffer(file) == -1) {
+                    return -1; // Error writing block to disk
+                }
+                if (file->wb_buf == NULL && (file->wb_buf = malloc(BLOCK_SIZE)) == NULL) {
+                    return -1; // Memory allocation failed
+                }
+                file->wb_block = -1;
+                if (new_block) {
+                    memset(file->wb_buf, 0, BLOCK_SIZE);
+                } else if (disk_read(super_block.data_blocks_offset + block_offset, 1, file->wb_buf) == -1) {
+                    return -1; // Error reading block from disk
+                }
+                file->wb_block = current_block;
+            }
+            memcpy(file->wb_buf + block_pos, src, bytes_in_block);
+            file->wb_dirty = 1;
+            invalidate_cached_blocks(index, current_block, 1, file);
+            bytes_written += bytes_in_block; // Update total bytes written
+            continue;
+        }
+
+        // Full blocks: extend the run while the next blocks are physically contiguous
+        int run = 1;
+        while ((run + 1) * BLOCK_SIZE <= (int)nbyte - bytes_written && current_block + run < MAX_FILE_BLOCKS) {
+            int next_offset = bmap(index, current_block + run, 1);
+            if (next_offset == BMAP_ERROR) {
+                return -1; // Error reading block map from disk
+            }
+            if (next_offset == -1) {
+                break; // No more free blocks
+            }
+            if (next_offset != block_offset + run) {
+                break; // Run is not contiguous on disk
+            }
+            run++;
+        }
+
+        if (disk_write(super_block.data_blocks_offset + block_offset, run, (void *)src) == -1) {
+            return -1; // Error writing blocks to disk
         }
+        if (file->wb_block >= current_block && file->wb_block < current_block + run) {
+            file->wb_block = -1; // Buffered copy was fully overwritten
+            file->wb_dirty = 0;
+        }
+        invalidate_cached_blocks(index, current_block, run, file);
 
-        bytes_written += bytes_in_block; // Update total bytes written
-        remaining_bytes -= bytes_in_block; // Update remaining bytes
-        current_block++; // Move to next block
+        bytes_written += run * BLOCK_SIZE; // Update total bytes written
     }
 
     // Update file size if necessary
-    if (inode_table[index].size < bytes_written) {
-        inode_table[index].size = bytes_written;
+    if (inode_table[index].size < offset + bytes_written) {
+        inode_table[index].size = offset + bytes_written;
+        mark_inode_dirty(index);
     }
 
     return bytes_written; // Return total bytes written
 }
 
+int fs_read(int fd, void *buf, size_t nbyte) { // Read from a file at the descriptor's offset
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
+        return -1; // Invalid file descriptor
+    }
+
+    int index = file->inode_index;
+    int bytes_read = -1;
+    if (lock_inode_for_read(index) == 0) {
+        bytes_read = read_at(file, buf, nbyte, file->offset);
+        if (bytes_read > 0) {
+            file->offset += bytes_read; // Advance the file pointer past the data read
+        }
+        pthread_rwlock_unlock(&inode_locks[index]);
+    }
+
+    release_fd(file);
+    return leave_operation(bytes_read); // Return total bytes read
+}
+
+int write_fd(int fd, const void *buf, size_t nbyte, off_t offset) { // One write through a descriptor, at offset or at the file pointer if offset is -1
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
+        return -1; // Invalid file descriptor
+    }
+
+    int index = file->inode_index;
+    pthread_rwlock_wrlock(&inode_locks[index]);
+    int bytes_written;
+    if (offset != -1) {
+        bytes_written = write_at(file, buf, nbyte, offset);
+    } else {
+        if (file->flags & FS_O_APPEND) {
+            file->offset = inode_table[index].size; // Appends always land at the current end of file
+        }
+        bytes_written = write_at(file, buf, nbyte, file->offset);
+        if (bytes_written > 0) {
+            file->offset += bytes_written; // Advance the file pointer past the data written
+        }
+    }
+    pthread_rwlock_unlock(&inode_locks[index]);
+
+    release_fd(file);
+    return end_operation(bytes_written); // Return total bytes written
+}
+
+int write_fd_fully(int fd, const void *buf, size_t nbyte, off_t offset) { // write_fd, going on when it stopped only because freed blocks waited for a commit
+    int total = 0;
+    for (;;) {
+        size_t left = nbyte - total;
+        if (left > (size_t)(MAX_IO_SIZE - total)) {
+            left = MAX_IO_SIZE - total; // The total has to fit the int returned
+        }
+        allocation_starved_here = 0;
+        int ret = write_fd(fd, (const char *)buf + total, left, (offset == -1) ? -1 : offset + total);
+        // end_operation committed once it saw the starved allocation, so the freed blocks can be used now
+        if (ret == -1 && !allocation_starved_here) {
+            return (total > 0) ? total : -1; // Report what was written before the error
+        }
+        if (ret > 0) {
+            total += ret;
+        }
+        if (!allocation_starved_here || (size_t)total >= nbyte || total >= MAX_IO_SIZE) {
+            return total;
+        }
+    }
+}
+
+int fs_write(int fd, const void *buf, size_t nbyte) { // Write to a file at the descriptor's offset
+    return write_fd_fully(fd, buf, nbyte, -1);
+}
+
+int fs_pread(int fd, void *buf, size_t nbyte, off_t offset) { // Read from a file at offset without moving the file pointer
+    if (offset < 0) {
+        return -1; // Invalid offset
+    }
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
+        return -1; // Invalid file descriptor
+    }
+
+    int index = file->inode_index;
+    int bytes_read = -1;
+    if (lock_inode_for_read(index) == 0) {
+        bytes_read = read_at(file, buf, nbyte, offset);
+        pthread_rwlock_unlock(&inode_locks[index]);
+    }
+
+    release_fd(file);
+    return leave_operation(bytes_read); // Return total bytes read
+}
+
+int fs_pwrite(int fd, const void *buf, size_t nbyte, off_t offset) { // Write to a file at offset without moving the file pointer
+    if (offset < 0) {
+        return -1; // Invalid offset
+    }
+    return write_fd_fully(fd, buf, nbyte, offset);
+}
+
+off_t fs_get_filesize64(int fd) { // Get the size of an open file, however large
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
+        return -1; // Invalid file descriptor
+    }
+
+    int index = file->inode_index;
+    pthread_rwlock_rdlock(&inode_locks[index]);
+    off_t size = inode_table[index].size;
+    pthread_rwlock_unlock(&inode_locks[index]);
+
+    release_fd(file);
+    leave_operation(0);
+    return size;
+}
+
+int fs_get_filesize(int fd) { // Get the size of an open file; -1 if it does not fit in an int, like stat's EOVERFLOW
+    off_t size = fs_get_filesize64(fd);
+    return size > INT_MAX ? -1 : (int)size;
+}
+
 int fs_listfiles(char ***files) { // List all files in the file system
     char **file_list = malloc(MAX_FILE_COUNT * sizeof(char *)); // Allocate memory for file list
     if (file_list == NULL) {
@@ -313,6 +1952,9 @@ int fs_listfiles(char ***files) { // List all files in the file system
 
     int file_count = 0; // Total number of files
 
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(&directory_lock);
+
     // Populate files array with file names
     for (int i = 0; i < MAX_FILE_COUNT; i++) {
         if (root_directory[i].inode_index != -1) {
@@ -323,7 +1965,8 @@ int fs_listfiles(char ***files) { // List all files in the file system
                     free(file_list[j]);
                 }
                 free(file_list);
-                return -1; // Memory allocation failed
+                pthread_rwlock_unlock(&directory_lock);
+                return leave_operation(-1); // Memory allocation failed
             }
 
             strcpy(file_list[file_count], root_directory[i].name); // Copy file name to list
@@ -331,52 +1974,343 @@ int fs_listfiles(char ***files) { // List all files in the file system
         }
     }
 
+    pthread_rwlock_unlock(&directory_lock);
+
     *files = file_list; // Assign file list to output parameter
 
-    return 0; // File list generated successfully
+    return leave_operation(0); // File list generated successfully
 }
 
 int fs_lseek(int fd, off_t offset) { // Set the file pointer to the specified offset
-    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT || file_descriptor_table[fd] == 0) {
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
         return -1; // Invalid file descriptor
     }
 
-    int index = file_descriptor_table[fd];
-    if (offset < 0 || offset > inode_table[index].size) {
-        return -1; // Invalid offset
+    int index = file->inode_index;
+    int ret = -1;
+    pthread_rwlock_rdlock(&inode_locks[index]);
+    if (offset >= 0 && offset <= inode_table[index].size) {
+        // Set file pointer to the specified offset
+        file->offset = offset;
+        ret = 0;
     }
+    pthread_rwlock_unlock(&inode_locks[index]);
 
-    // Set file pointer to the specified offset
-    inode_table[index].file_pointer = offset;
-
-    return 0; // File pointer set successfully
+    release_fd(file);
+    return leave_operation(ret); // File pointer set unless the offset was invalid
 }
 
 
-int fs_truncate(int fd, off_t length) { // Truncate a file to the specified length
-    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT || file_descriptor_table[fd] == 0) {
-        return -1; // Invalid file descriptor
-    }
-
-    int index = file_descriptor_table[fd];
+int truncate_inode(int index, off_t length) { // Truncate an inode; caller holds the inode's write lock
     if (length < 0 || length > inode_table[index].size) {
         return -1; // Invalid length
     }
 
-    // Truncate file
-    int current_block = length / 4096; // Current block index
-    int remaining_bytes = length % 4096; // Remaining bytes in last block
+    if (inode_table[index].flags & INODE_INLINE) {
+        // Keep the bytes past the end zero so a later extension reads zeros
+        memset(inode_table[index].inline_data + length, 0, inode_table[index].size - length);
+    } else {
+        // Buffered and prefetched copies must not outlive the blocks freed below
+        if (flush_inode_buffers(index, NULL) == -1) {
+            return -1; // Error writing buffered data to disk
+        }
+        invalidate_cached_blocks(index, 0, MAX_FILE_BLOCKS, NULL);
+
+        // Truncate file
+        int first_free_block = (length + BLOCK_SIZE - 1) / BLOCK_SIZE; // First block no longer covered by the file
+
+        // Free data blocks beyond the truncated size
+        if (free_file_blocks(index, first_free_block) == -1) {
+            return -1; // Error freeing data blocks
+        }
 
-    // Free data blocks beyond the truncated size
-    for (int i = current_block + 1; i < 256; i++) {
-        if (inode_table[index].data_block_offsets[i] != -1) {
-            bitmap[inode_table[index].data_block_offsets[i]] = 0;
-            inode_table[index].data_block_offsets[i] = -1;
+        // Zero the rest of the new last block, as for inline files, so a later extension does not bring old bytes back
+        if (length % BLOCK_SIZE != 0) {
+            int block_offset = bmap(index, length / BLOCK_SIZE, 0);
+            if (block_offset == BMAP_ERROR) {
+                return -1; // Error reading block map from disk
+            }
+            if (block_offset != -1) {
+                char block_buf[BLOCK_SIZE];
+                if (disk_read(super_block.data_blocks_offset + block_offset, 1, block_buf) == -1) {
+                    return -1; // Error reading block from disk
+                }
+                memset(block_buf + length % BLOCK_SIZE, 0, BLOCK_SIZE - length % BLOCK_SIZE);
+                if (disk_write(super_block.data_blocks_offset + block_offset, 1, block_buf) == -1) {
+                    return -1; // Error writing block to disk
+                }
+            }
         }
     }
 
     // Update file size
     inode_table[index].size = length;
+    mark_inode_dirty(index);
+
+    // Pull back any file pointers that now point past the end of the file
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR_COUNT; i++) {
+        if (fd_is_open(&file_descriptor_table[i]) && file_descriptor_table[i].inode_index == index && file_descriptor_table[i].offset > length) {
+            file_descriptor_table[i].offset = length;
+        }
+    }
 
     return 0; // File truncated successfully
 }
+
+int fs_truncate(int fd, off_t length) { // Truncate a file to the specified length
+    struct OpenFile *file = acquire_fd(fd);
+    if (file == NULL) {
+        return -1; // Invalid file descriptor
+    }
+
+    int index = file->inode_index;
+    pthread_rwlock_wrlock(&inode_locks[index]);
+    int ret = truncate_inode(index, length);
+    pthread_rwlock_unlock(&inode_locks[index]);
+
+    release_fd(file);
+    return end_operation(ret); // File truncated once the operation is logged
+}
+
+// Asynchronous I/O
+
+void async_execute(int *batch, int count) { // Run a batch of requests that continue each other on one descriptor
+    struct AsyncRequest *first = &async_requests[batch[0]];
+    if (count == 1) {
+        first->result = first->is_write ? fs_pwrite(first->fd, first->buf, first->nbyte, first->offset)
+                                        : fs_pread(first->fd, first->buf, first->nbyte, first->offset);
+        return;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += async_requests[batch[i]].nbyte;
+    }
+
+    char *merged = malloc(total);
+    if (merged == NULL) {
+        // Fall back to one call per request
+        for (int i = 0; i < count; i++) {
+            async_execute(&batch[i], 1);
+        }
+        return;
+    }
+
+    // One call covers the whole range; the bounce buffer is split back up afterwards
+    int done;
+    if (first->is_write) {
+        for (int i = 0; i < count; i++) {
+            struct AsyncRequest *req = &async_requests[batch[i]];
+            memcpy(merged + (req->offset - first->offset), req->buf, req->nbyte);
+        }
+        done = fs_pwrite(first->fd, merged, total, first->offset);
+    } else {
+        done = fs_pread(first->fd, merged, total, first->offset);
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct AsyncRequest *req = &async_requests[batch[i]];
+        long long pos = req->offset - first->offset; // Where this request starts in the merged range
+        long long got = done - pos; // Bytes of this request that were transferred
+        if (got < 0) {
+            got = 0;
+        } else if (got > (long long)req->nbyte) {
+            got = req->nbyte;
+        }
+        if (!first->is_write && got > 0) {
+            memcpy(req->buf, merged + pos, got);
+        }
+        req->result = (done == -1) ? -1 : (int)got;
+    }
+
+    free(merged);
+}
+
+void *async_worker(void *unused) { // Take requests off the queue, merging contiguous ones, until shutdown
+    (void)unused;
+    int batch[ASYNC_MAX_BATCH];
+
+    pthread_mutex_lock(&async_lock);
+    while (1) {
+        while (async_head == -1 && async_running) {
+            pthread_cond_wait(&async_queue_cond, &async_lock);
+        }
+        if (async_head == -1) {
+            break; // Shutting down and nothing left to do
+        }
+
+        // Pop the head, then pull in queued requests that continue it on the same descriptor
+        int count = 0;
+        struct AsyncRequest *first = &async_requests[async_head];
+        batch[count++] = async_head;
+        async_head = first->next;
+        first->state = ASYNC_RUNNING;
+        off_t end = first->offset + first->nbyte;
+        size_t total = first->nbyte;
+
+        int merged = 1;
+        while (merged && count < ASYNC_MAX_BATCH) {
+            merged = 0;
+            for (int prev = -1, i = async_head; i != -1; prev = i, i = async_requests[i].next) {
+                struct AsyncRequest *req = &async_requests[i];
+                if (req->fd == first->fd && req->is_write == first->is_write && req->offset == end
+                    && total + req->nbyte <= ASYNC_MAX_MERGE_BYTES) {
+                    if (prev == -1) {
+                        async_head = req->next;
+                    } else {
+                        async_requests[prev].next = req->next;
+                    }
+                    req->state = ASYNC_RUNNING;
+                    batch[count++] = i;
+                    end += req->nbyte;
+                    total += req->nbyte;
+                    merged = 1;
+                    break; // Rescan: the range end moved
+                }
+            }
+        }
+        // Recompute the tail after unlinking from the middle of the queue
+        async_tail = -1;
+        for (int i = async_head; i != -1; i = async_requests[i].next) {
+            async_tail = i;
+        }
+        pthread_mutex_unlock(&async_lock);
+
+        async_execute(batch, count);
+
+        // Callbacks run without the lock so they can submit more requests
+        for (int i = 0; i < count; i++) {
+            struct AsyncRequest *req = &async_requests[batch[i]];
+            if (req->callback != NULL) {
+                req->callback(batch[i], req->result, req->arg);
+            }
+        }
+
+        pthread_mutex_lock(&async_lock);
+        for (int i = 0; i < count; i++) {
+            struct AsyncRequest *req = &async_requests[batch[i]];
+            if (req->callback != NULL) {
+                req->state = ASYNC_FREE; // Completion was delivered by the callback
+            } else {
+                req->state = ASYNC_DONE; // Completion waits for fs_poll or fs_wait
+            }
+        }
+        async_in_flight -= count;
+        pthread_cond_broadcast(&async_done_cond);
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    return NULL;
+}
+
+int async_submit(int is_write, int fd, void *buf, size_t nbyte, off_t offset, void (*callback)(int, int, void *), void *arg) { // Queue a request for the worker threads
+    if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR_COUNT || offset < 0) {
+        return -1; // Invalid file descriptor or offset
+    }
+
+    pthread_mutex_lock(&async_lock);
+
+    if (!async_running) {
+        async_running = 1;
+        for (int i = 0; i < ASYNC_WORKER_COUNT; i++) {
+            if (pthread_create(&async_workers[i], NULL, async_worker, NULL) != 0) {
+                async_running = 0; // Cannot run requests without workers
+                pthread_cond_broadcast(&async_queue_cond);
+                pthread_mutex_unlock(&async_lock);
+                for (int j = 0; j < i; j++) {
+                    pthread_join(async_workers[j], NULL);
+                }
+                return -1;
+            }
+        }
+    }
+
+    int request = -1;
+    for (int i = 0; i < MAX_ASYNC_REQUESTS; i++) {
+        if (async_requests[i].state == ASYNC_FREE) {
+            request = i;
+            break;
+        }
+    }
+    if (request == -1) {
+        pthread_mutex_unlock(&async_lock);
+        return -1; // Too many outstanding requests
+    }
+
+    struct AsyncRequest *req = &async_requests[request];
+    req->state = ASYNC_QUEUED;
+    req->is_write = is_write;
+    req->fd = fd;
+    req->buf = buf;
+    req->nbyte = nbyte;
+    req->offset = offset;
+    req->result = -1;
+    req->callback = callback;
+    req->arg = arg;
+    req->next = -1;
+
+    if (async_tail == -1) {
+        async_head = request;
+    } else {
+        async_requests[async_tail].next = request;
+    }
+    async_tail = request;
+    async_in_flight++;
+
+    pthread_cond_signal(&async_queue_cond);
+    pthread_mutex_unlock(&async_lock);
+
+    return request; // Handle for fs_poll and fs_wait
+}
+
+int fs_submit_read(int fd, void *buf, size_t nbyte, off_t offset, void (*callback)(int, int, void *), void *arg) { // Queue a read of nbyte bytes at offset
+    return async_submit(0, fd, buf, nbyte, offset, callback, arg);
+}
+
+int fs_submit_write(int fd, const void *buf, size_t nbyte, off_t offset, void (*callback)(int, int, void *), void *arg) { // Queue a write of nbyte bytes at offset
+    return async_submit(1, fd, (void *)buf, nbyte, offset, callback, arg);
+}
+
+int fs_poll(int request, int *result) { // Check a request submitted without a callback; 1 and its result once done, 0 while pending
+    if (request < 0 || request >= MAX_ASYNC_REQUESTS) {
+        return -1; // Invalid request
+    }
+
+    pthread_mutex_lock(&async_lock);
+    struct AsyncRequest *req = &async_requests[request];
+    int ret;
+    if (req->state == ASYNC_FREE || req->callback != NULL) {
+        ret = -1; // Not a request that can be polled
+    } else if (req->state == ASYNC_DONE) {
+        *result = req->result;
+        req->state = ASYNC_FREE;
+        ret = 1;
+    } else {
+        ret = 0; // Still queued or running
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    return ret;
+}
+
+int fs_wait(int request) { // Block until a request submitted without a callback is done and return its result
+    if (request < 0 || request >= MAX_ASYNC_REQUESTS) {
+        return -1; // Invalid request
+    }
+
+    pthread_mutex_lock(&async_lock);
+    struct AsyncRequest *req = &async_requests[request];
+    if (req->state == ASYNC_FREE || req->callback != NULL) {
+        pthread_mutex_unlock(&async_lock);
+        return -1; // Not a request that can be waited for
+    }
+    while (req->state != ASYNC_DONE) {
+        pthread_cond_wait(&async_done_cond, &async_lock);
+    }
+    int result = req->result;
+    req->state = ASYNC_FREE;
+    pthread_mutex_unlock(&async_lock);
+
+    return result;
+}
@@ -0,0 +1,448 @@
+// fs_bench.c: benchmark and workload replay tool for fs.c
+// Usage: fs_bench [-d disk] [-m] [-t trace]
+//   -d disk   virtual disk to create (default fs_bench.disk); it is overwritten
+//   -m        mount with the mmap backend; blocks copied out of the mapping count as reads
+//   -t trace  replay a recorded trace instead of the standard workloads
+//
+// Trace files hold one operation per line; blank lines and lines starting with # are skipped:
+//   create NAME | delete NAME | open NAME | close NAME | sync
+//   write NAME OFFSET LENGTH | read NAME OFFSET LENGTH | append NAME LENGTH | truncate NAME LENGTH
+// Files named by read/write/append/truncate are opened on first use.
+
+#include "fs.h"
+#include "fs_ext.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SMALL_FILE_COUNT 48 // Files per round of the create/delete storm
+#define SMALL_FILE_ROUNDS 20 // Rounds of the create/delete storm
+#define SEQUENTIAL_FILE_SIZE (4 * 1024 * 1024) // Bytes written and read by the sequential workload
+#define RANDOM_OPS 2000 // Operations per random workload
+#define LOG_RECORDS 20000 // Records appended by the logging workload
+#define LOG_RECORD_SIZE 100 // Bytes per log record
+#define MAX_TRACE_FILES 64 // Files a trace can keep open
+
+struct Bench {
+    const char *name; // Workload name printed in the report
+    double start; // Wall clock time the workload started
+    double *latencies; // Per-operation latency in seconds
+    int count; // Operations recorded
+    int capacity; // Size of latencies
+    long long bytes; // Bytes transferred
+    int failures; // Operations that returned -1 or moved fewer bytes than asked
+    long long io_start[4]; // fs_get_io_stats when the workload started
+};
+
+const char *disk_name = "fs_bench.disk";
+int mount_options = 0;
+char io_buf[1024 * 1024]; // Data source and sink for every workload
+int total_failures; // Failed operations over every workload, for the exit status
+
+double now() { // Monotonic time in seconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_begin(struct Bench *b, const char *name) { // Start timing a workload
+    memset(b, 0, sizeof(*b));
+    b->name = name;
+    fs_get_io_stats(&b->io_start[0], &b->io_start[1], &b->io_start[2], &b->io_start[3]);
+    b->start = now();
+}
+
+void bench_op(struct Bench *b, double op_start, int ret, long long bytes) { // Record one operation that began at op_start and returned ret; a failed one moves no bytes
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 1024;
+        b->latencies = realloc(b->latencies, b->capacity * sizeof(double));
+        if (b->latencies == NULL) {
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    b->latencies[b->count++] = now() - op_start;
+    if (ret == -1) {
+        b->failures++;
+    } else {
+        b->bytes += bytes;
+    }
+}
+
+void bench_transfer(struct Bench *b, double op_start, int ret, int size) { // Record a read or write of size bytes; a short one counts as failed
+    bench_op(b, op_start, (ret == size) ? ret : -1, size);
+}
+
+int require(int ret, const char *what) { // Stop the benchmark if a setup step fails
+    if (ret == -1) {
+        fprintf(stderr, "ERROR: %s failed\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(struct Bench *b, double p) { // Latency at percentile p of a sorted run, in microseconds
+    if (b->count == 0) {
+        return 0;
+    }
+    int i = (int)(p / 100 * (b->count - 1) + 0.5);
+    return b->latencies[i] * 1e6;
+}
+
+void bench_end(struct Bench *b) { // Print a workload's throughput, latency and block I/O
+    double elapsed = now() - b->start;
+    long long io[4];
+    fs_get_io_stats(&io[0], &io[1], &io[2], &io[3]);
+
+    qsort(b->latencies, b->count, sizeof(double), compare_doubles);
+    printf("%-22s %8d ops %10.0f ops/s %9.2f MB/s  p50 %8.1f us  p95 %8.1f us  p99 %8.1f us  reads %lld (%lld blk)  writes %lld (%lld blk)  failed %d\n",
+           b->name, b->count, b->count / elapsed, b->bytes / elapsed / (1024 * 1024),
+           percentile(b, 50), percentile(b, 95), percentile(b, 99),
+           io[0] - b->io_start[0], io[1] - b->io_start[1], io[2] - b->io_start[2], io[3] - b->io_start[3], b->failures);
+    total_failures += b->failures;
+    free(b->latencies);
+}
+
+void fresh_fs() { // Format and mount an empty file system
+    if (make_fs(disk_name) == -1 || mount_fs_options(disk_name, mount_options) == -1) {
+        fprintf(stderr, "ERROR: cannot create file system on %s\n", disk_name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void finish_fs() { // Unmount the file system, flushing everything
+    if (umount_fs(disk_name) == -1) {
+        fprintf(stderr, "ERROR: cannot unmount %s\n", disk_name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Workloads
+
+void small_file_storm() { // Create, write, close and delete many tiny files
+    struct Bench b;
+    char name[16];
+    fresh_fs();
+    bench_begin(&b, "small-file storm");
+
+    for (int round = 0; round < SMALL_FILE_ROUNDS; round++) {
+        for (int i = 0; i < SMALL_FILE_COUNT; i++) {
+            snprintf(name, sizeof(name), "s%d", i);
+            double t = now();
+            bench_op(&b, t, fs_create(name), 0);
+
+            t = now();
+            int fd = fs_open(name);
+            bench_op(&b, t, fd, 0);
+
+            t = now();
+            bench_transfer(&b, t, fs_write(fd, io_buf, 64), 64);
+
+            t = now();
+            bench_op(&b, t, fs_close(fd), 0);
+        }
+        for (int i = 0; i < SMALL_FILE_COUNT; i++) {
+            snprintf(name, sizeof(name), "s%d", i);
+            double t = now();
+            bench_op(&b, t, fs_delete(name), 0);
+        }
+    }
+    require(fs_sync(), "fs_sync"); // The metadata the storm produced is part of its cost
+    bench_end(&b);
+    finish_fs();
+}
+
+void sequential_io(int io_size) { // Stream a file in and out in io_size chunks
+    struct Bench b;
+    char name[32];
+    fresh_fs();
+    require(fs_create("seq"), "fs_create");
+    int fd = require(fs_open("seq"), "fs_open");
+
+    snprintf(name, sizeof(name), "seq write %d", io_size);
+    bench_begin(&b, strdup(name));
+    for (int pos = 0; pos < SEQUENTIAL_FILE_SIZE; pos += io_size) {
+        double t = now();
+        bench_transfer(&b, t, fs_write(fd, io_buf, io_size), io_size);
+    }
+    require(fs_sync(), "fs_sync");
+    bench_end(&b);
+    free((char *)b.name);
+
+    require(fs_lseek(fd, 0), "fs_lseek");
+    snprintf(name, sizeof(name), "seq read %d", io_size);
+    bench_begin(&b, strdup(name));
+    for (int pos = 0; pos < SEQUENTIAL_FILE_SIZE; pos += io_size) {
+        double t = now();
+        bench_transfer(&b, t, fs_read(fd, io_buf, io_size), io_size);
+    }
+    bench_end(&b);
+    free((char *)b.name);
+
+    require(fs_close(fd), "fs_close");
+    finish_fs();
+}
+
+void random_io(int io_size) { // Read and write io_size chunks at random aligned offsets
+    struct Bench b;
+    char name[32];
+    int slots = SEQUENTIAL_FILE_SIZE / io_size; // Aligned positions in the file
+    fresh_fs();
+    require(fs_create("rand"), "fs_create");
+    int fd = require(fs_open("rand"), "fs_open");
+    for (int pos = 0; pos < SEQUENTIAL_FILE_SIZE; pos += (int)sizeof(io_buf)) {
+        if (fs_write(fd, io_buf, sizeof(io_buf)) != (int)sizeof(io_buf)) {
+            require(-1, "fs_write");
+        }
+    }
+    require(fs_sync(), "fs_sync");
+    srand(1);
+
+    snprintf(name, sizeof(name), "rand write %d", io_size);
+    bench_begin(&b, strdup(name));
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        off_t offset = (off_t)(rand() % slots) * io_size;
+        double t = now();
+        bench_transfer(&b, t, fs_pwrite(fd, io_buf, io_size, offset), io_size);
+    }
+    require(fs_sync(), "fs_sync");
+    bench_end(&b);
+    free((char *)b.name);
+
+    snprintf(name, sizeof(name), "rand read %d", io_size);
+    bench_begin(&b, strdup(name));
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        off_t offset = (off_t)(rand() % slots) * io_size;
+        double t = now();
+        bench_transfer(&b, t, fs_pread(fd, io_buf, io_size, offset), io_size);
+    }
+    bench_end(&b);
+    free((char *)b.name);
+
+    require(fs_close(fd), "fs_close");
+    finish_fs();
+}
+
+void append_log() { // Append small records the way a log writer does
+    struct Bench b;
+    fresh_fs();
+    require(fs_create("log"), "fs_create");
+    int fd = require(fs_open_flags("log", FS_O_APPEND), "fs_open_flags");
+
+    bench_begin(&b, "append log");
+    for (int i = 0; i < LOG_RECORDS; i++) {
+        double t = now();
+        bench_transfer(&b, t, fs_write(fd, io_buf, LOG_RECORD_SIZE), LOG_RECORD_SIZE);
+    }
+    require(fs_close(fd), "fs_close");
+    require(fs_sync(), "fs_sync");
+    bench_end(&b);
+
+    finish_fs();
+}
+
+void mount_time() { // Time mount and unmount as the number of files grows
+    char name[16];
+    for (int files = 0; files <= SMALL_FILE_COUNT; files += SMALL_FILE_COUNT / 4) {
+        fresh_fs();
+        for (int i = 0; i < files; i++) {
+            snprintf(name, sizeof(name), "m%d", i);
+            require(fs_create(name), "fs_create");
+            int fd = require(fs_open(name), "fs_open");
+            if (fs_write(fd, io_buf, 4096) != 4096) {
+                require(-1, "fs_write");
+            }
+            require(fs_close(fd), "fs_close");
+        }
+        finish_fs();
+
+        char label[32];
+        struct Bench b;
+        snprintf(label, sizeof(label), "mount+umount %d files", files);
+        bench_begin(&b, label);
+        for (int i = 0; i < 20; i++) {
+            double t = now();
+            if (mount_fs_options(disk_name, mount_options) == -1 || umount_fs(disk_name) == -1) {
+                fprintf(stderr, "ERROR: mount failed with %d files\n", files);
+                exit(EXIT_FAILURE);
+            }
+            bench_op(&b, t, 0, 0);
+        }
+        bench_end(&b);
+    }
+}
+
+// Trace replay
+
+struct TraceFile {
+    char name[32]; // File name used in the trace
+    int fd; // Open descriptor, -1 if closed
+};
+
+struct TraceFile trace_files[MAX_TRACE_FILES];
+int trace_file_count;
+
+struct TraceFile *trace_lookup(const char *name) { // Find a trace file by name, adding it if new
+    for (int i = 0; i < trace_file_count; i++) {
+        if (strcmp(trace_files[i].name, name) == 0) {
+            return &trace_files[i];
+        }
+    }
+    if (trace_file_count == MAX_TRACE_FILES) {
+        return NULL; // Too many files in the trace
+    }
+    struct TraceFile *file = &trace_files[trace_file_count++];
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->fd = -1;
+    return file;
+}
+
+int trace_fd(struct TraceFile *file) { // Descriptor for a trace file, opening it on first use
+    if (file->fd == -1) {
+        file->fd = fs_open(file->name);
+    }
+    return file->fd;
+}
+
+int replay_trace(const char *path) { // Replay every operation in a trace file, returning the number of failures
+    FILE *trace = fopen(path, "r");
+    if (trace == NULL) {
+        perror("fopen failed");
+        return -1;
+    }
+
+    struct Bench b;
+    char line[256], op[16], name[32];
+    long long a1, a2;
+    int failures = 0, line_number = 0;
+
+    fresh_fs();
+    bench_begin(&b, "replay");
+
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        a1 = a2 = 0;
+        int fields = sscanf(line, "%15s %31s %lld %lld", op, name, &a1, &a2);
+        if (fields < 1) {
+            continue;
+        }
+        if (a1 < 0 || a2 < 0) { // Offsets and lengths are never negative; a length would turn into a huge size_t
+            fprintf(stderr, "line %d: cannot parse: %s", line_number, line);
+            failures++;
+            continue;
+        }
+        struct TraceFile *file = (fields >= 2) ? trace_lookup(name) : NULL;
+        if (fields >= 2 && file == NULL) {
+            fprintf(stderr, "line %d: too many files in trace\n", line_number);
+            failures++;
+            continue;
+        }
+
+        int ret;
+        long long bytes = 0;
+        double t = now();
+        if (strcmp(op, "sync") == 0) {
+            ret = fs_sync();
+        } else if (strcmp(op, "create") == 0 && fields == 2) {
+            ret = fs_create(name);
+        } else if (strcmp(op, "delete") == 0 && fields == 2) {
+            if (file->fd != -1) {
+                fs_close(file->fd);
+                file->fd = -1;
+            }
+            ret = fs_delete(name);
+        } else if (strcmp(op, "open") == 0 && fields == 2) {
+            ret = trace_fd(file);
+        } else if (strcmp(op, "close") == 0 && fields == 2) {
+            ret = fs_close(file->fd);
+            file->fd = -1;
+        } else if (strcmp(op, "write") == 0 && fields == 4 && a2 <= (long long)sizeof(io_buf)) {
+            ret = fs_pwrite(trace_fd(file), io_buf, a2, a1);
+            bytes = a2;
+        } else if (strcmp(op, "read") == 0 && fields == 4 && a2 <= (long long)sizeof(io_buf)) {
+            ret = fs_pread(trace_fd(file), io_buf, a2, a1);
+            bytes = a2;
+        } else if (strcmp(op, "append") == 0 && fields == 3 && a1 <= (long long)sizeof(io_buf)) {
+            int fd = trace_fd(file);
+            ret = fs_lseek(fd, fs_get_filesize64(fd));
+            if (ret != -1) {
+                ret = fs_write(fd, io_buf, a1);
+            }
+            bytes = a1;
+        } else if (strcmp(op, "truncate") == 0 && fields == 3) {
+            ret = fs_truncate(trace_fd(file), a1);
+        } else {
+            fprintf(stderr, "line %d: cannot parse: %s", line_number, line);
+            failures++;
+            continue;
+        }
+        bench_op(&b, t, ret, bytes);
+    }
+
+    fclose(trace);
+    for (int i = 0; i < trace_file_count; i++) {
+        if (trace_files[i].fd != -1) {
+            fs_close(trace_files[i].fd);
+        }
+    }
+    require(fs_sync(), "fs_sync");
+    bench_end(&b);
+    finish_fs();
+
+    failures += b.failures;
+    printf("replay: %d failed operations\n", failures);
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:mt:")) != -1) {
+        switch (opt) {
+        case 'd':
+            disk_name = optarg;
+            break;
+        case 'm':
+            mount_options |= FS_MOUNT_MMAP;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d disk] [-m] [-t trace]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(io_buf); i++) {
+        io_buf[i] = (char)i;
+    }
+
+    if (trace_path != NULL) {
+        return replay_trace(trace_path) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    int io_sizes[] = {512, 4096, 65536};
+    small_file_storm();
+    for (int i = 0; i < 3; i++) {
+        sequential_io(io_sizes[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        random_io(io_sizes[i]);
+    }
+    append_log();
+    mount_time();
+
+    return total_failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
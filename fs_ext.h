@@ -0,0 +1,32 @@
+// fs_ext.h
+// fs.c entry points beyond the fs.h interface
+
+#ifndef FS_EXT_H
+#define FS_EXT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Open flags for fs_open_flags
+#define FS_O_APPEND 0x1 // Every write goes to the current end of the file
+
+// Options for mount_fs_options
+#define FS_MOUNT_MMAP 0x1 // Access the disk image through a shared memory mapping
+
+int mount_fs_options(const char *disk_name, int options);
+int fs_sync();
+
+int fs_open_flags(const char *name, int flags);
+int fs_pread(int fd, void *buf, size_t nbyte, off_t offset);
+int fs_pwrite(int fd, const void *buf, size_t nbyte, off_t offset);
+off_t fs_get_filesize64(int fd);
+
+// Asynchronous I/O; a request with a callback is freed when the callback returns, others by fs_poll or fs_wait
+int fs_submit_read(int fd, void *buf, size_t nbyte, off_t offset, void (*callback)(int request, int result, void *arg), void *arg);
+int fs_submit_write(int fd, const void *buf, size_t nbyte, off_t offset, void (*callback)(int request, int result, void *arg), void *arg);
+int fs_poll(int request, int *result);
+int fs_wait(int request);
+
+void fs_get_io_stats(long long *read_calls, long long *blocks_read, long long *write_calls, long long *blocks_written);
+
+#endif
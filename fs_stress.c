@@ -0,0 +1,483 @@
+// fs_stress.c: multi-threaded stress and throughput test for fs.c
+// Usage: fs_stress [max_threads]. Runs each phase with 1, 2, 4, ... up to max_threads threads,
+// first through disk.h and then again with the disk mounted through FS_MOUNT_MMAP.
+// Before that, a recovery check crashes a child process with the file system mounted and checks the remount.
+
+#include "fs.h"
+#include "fs_ext.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DISK_NAME "fs_stress.disk" // Virtual disk created for the test
+#define FILE_SIZE (256 * 1024) // Bytes written and read per file per round
+#define CHUNK_SIZE 4096 // Bytes per fs_read/fs_write call
+#define ROUNDS 8 // Passes over each file per phase
+#define MAX_THREADS 16 // Leaves enough descriptors for every thread
+#define KEEP_GROWTH (3200 * CHUNK_SIZE) // Uncommitted growth in the recovery check, enough to push the file's indirect blocks out of the cache
+#define LEAK_SLACK 8 // Blocks the recovery check lets indirect blocks account for when it looks for leaked space
+#define ASYNC_CHUNK 1024 // Bytes per asynchronous request, small so adjacent requests get merged
+#define ASYNC_BATCH 48 // Requests a thread submits before collecting them; not a divisor of the file's chunk count
+
+struct Worker {
+    int id; // Thread number, also selects the thread's private file
+    int errors; // Failed calls and data mismatches seen by this thread
+    long long bytes; // Bytes moved through the file system
+    double start; // When the thread started its I/O
+    double end; // When the thread finished its I/O
+    pthread_t thread;
+};
+
+struct AsyncOwner {
+    int pending; // Callbacks still to run
+    int errors; // Failures seen by callbacks
+};
+
+struct AsyncChunk {
+    int request; // Handle for fs_wait/fs_poll, -1 when the callback completes the request
+    int pos; // File offset of the chunk
+    int len; // Bytes the request should transfer
+    int seed; // Pattern the file is written with
+    int is_read;
+    struct AsyncOwner *owner; // Counters the callback updates
+    char buf[ASYNC_CHUNK];
+};
+
+pthread_barrier_t start_barrier; // Lines threads up so the timing covers only the I/O
+const char *backend_name; // Backend the phases run on, for the report
+pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER; // Guards every AsyncOwner
+pthread_cond_t callback_cond = PTHREAD_COND_INITIALIZER; // Signalled as callbacks finish
+
+double now() { // Monotonic time in seconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char pattern_byte(int seed, int pos) { // Byte expected at pos in a file written with seed
+    return (char)(seed * 31 + pos * 7 + pos / CHUNK_SIZE);
+}
+
+int check_chunk(const char *buf, int seed, int pos, int len) { // Count bytes that differ from the expected pattern
+    int bad = 0;
+    for (int i = 0; i < len; i++) {
+        if (buf[i] != pattern_byte(seed, pos + i)) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+void *private_worker(void *arg) { // Each thread rewrites and verifies its own file
+    struct Worker *w = arg;
+    char name[16];
+    char buf[CHUNK_SIZE];
+    snprintf(name, sizeof(name), "t%d", w->id);
+
+    int fd = fs_open(name);
+    pthread_barrier_wait(&start_barrier);
+    w->start = w->end = now();
+    if (fd == -1) {
+        w->errors++;
+        return NULL;
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int seed = w->id * ROUNDS + round;
+        fs_lseek(fd, 0);
+        for (int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+            for (int i = 0; i < CHUNK_SIZE; i++) {
+                buf[i] = pattern_byte(seed, pos + i);
+            }
+            if (fs_write(fd, buf, CHUNK_SIZE) != CHUNK_SIZE) {
+                w->errors++;
+            }
+        }
+        fs_lseek(fd, 0);
+        for (int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+            if (fs_read(fd, buf, CHUNK_SIZE) != CHUNK_SIZE || check_chunk(buf, seed, pos, CHUNK_SIZE) != 0) {
+                w->errors++;
+            }
+        }
+        w->bytes += 2LL * FILE_SIZE;
+    }
+
+    w->end = now();
+    fs_close(fd);
+    return NULL;
+}
+
+void *shared_worker(void *arg) { // Every thread reads the same file through its own descriptor
+    struct Worker *w = arg;
+    char buf[CHUNK_SIZE];
+
+    int fd = fs_open("shared");
+    pthread_barrier_wait(&start_barrier);
+    w->start = w->end = now();
+    if (fd == -1) {
+        w->errors++;
+        return NULL;
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        fs_lseek(fd, 0);
+        for (int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+            if (fs_read(fd, buf, CHUNK_SIZE) != CHUNK_SIZE || check_chunk(buf, 0, pos, CHUNK_SIZE) != 0) {
+                w->errors++;
+            }
+        }
+        w->bytes += FILE_SIZE;
+    }
+
+    w->end = now();
+    fs_close(fd);
+    return NULL;
+}
+
+int async_bad(const struct AsyncChunk *chunk, int result) { // Nonzero if a finished request moved the wrong amount or wrong data
+    return result != chunk->len || (chunk->is_read && check_chunk(chunk->buf, chunk->seed, chunk->pos, chunk->len) != 0);
+}
+
+void async_callback(int request, int result, void *arg) { // Runs on an fs.c worker thread when a request finishes
+    struct AsyncChunk *chunk = arg;
+    int bad = async_bad(chunk, result);
+    (void)request;
+
+    pthread_mutex_lock(&callback_lock);
+    chunk->owner->errors += bad;
+    chunk->owner->pending--;
+    pthread_cond_broadcast(&callback_cond);
+    pthread_mutex_unlock(&callback_lock);
+}
+
+int async_pass(int fd, struct AsyncChunk *chunks, struct AsyncOwner *owner, int seed, int is_read) { // Write or read back the whole file in adjacent requests
+    int end = is_read ? FILE_SIZE + 2 * ASYNC_CHUNK : FILE_SIZE; // Reads run past EOF inside the last batch and must come back empty there
+    int errors = 0;
+    int pos = 0;
+
+    while (pos < end) {
+        int count = 0;
+        for (; count < ASYNC_BATCH && pos < end; count++, pos += ASYNC_CHUNK) {
+            struct AsyncChunk *chunk = &chunks[count];
+            chunk->pos = pos;
+            chunk->len = (FILE_SIZE - pos < ASYNC_CHUNK) ? FILE_SIZE - pos : ASYNC_CHUNK;
+            if (chunk->len < 0) {
+                chunk->len = 0; // Wholly past EOF
+            }
+            chunk->seed = seed;
+            chunk->is_read = is_read;
+            chunk->owner = owner;
+            for (int i = 0; i < ASYNC_CHUNK; i++) {
+                chunk->buf[i] = is_read ? 0 : pattern_byte(seed, pos + i);
+            }
+
+            // Alternate completion styles so merged batches mix callback and waited requests
+            void (*callback)(int, int, void *) = (count % 2 == 0) ? async_callback : NULL;
+            if (callback != NULL) {
+                pthread_mutex_lock(&callback_lock);
+                owner->pending++;
+                pthread_mutex_unlock(&callback_lock);
+            }
+            int request = is_read ? fs_submit_read(fd, chunk->buf, ASYNC_CHUNK, pos, callback, chunk)
+                                  : fs_submit_write(fd, chunk->buf, chunk->len, pos, callback, chunk);
+            if (request == -1) { // Request table full, collect what this thread has in flight first
+                if (callback != NULL) {
+                    pthread_mutex_lock(&callback_lock);
+                    owner->pending--;
+                    pthread_mutex_unlock(&callback_lock);
+                }
+                break;
+            }
+            chunk->request = (callback != NULL) ? -1 : request;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (chunks[i].request == -1) {
+                continue; // Checked by the callback
+            }
+            int result;
+            if (i % 4 == 1) {
+                result = fs_wait(chunks[i].request);
+            } else {
+                int done;
+                while ((done = fs_poll(chunks[i].request, &result)) == 0) {
+                    sched_yield();
+                }
+                if (done == -1) {
+                    result = -1;
+                }
+            }
+            errors += async_bad(&chunks[i], result);
+        }
+
+        pthread_mutex_lock(&callback_lock);
+        while (owner->pending > 0) {
+            pthread_cond_wait(&callback_cond, &callback_lock);
+        }
+        pthread_mutex_unlock(&callback_lock);
+
+        if (count == 0) {
+            sched_yield(); // Other threads hold every request slot
+        }
+    }
+    return errors;
+}
+
+void *submit_worker(void *arg) { // Each thread rewrites and verifies its own file through fs_submit_write/fs_submit_read
+    struct Worker *w = arg;
+    struct AsyncChunk chunks[ASYNC_BATCH];
+    struct AsyncOwner owner = {0, 0};
+    char name[16];
+    snprintf(name, sizeof(name), "t%d", w->id);
+
+    int fd = fs_open(name);
+    pthread_barrier_wait(&start_barrier);
+    w->start = w->end = now();
+    if (fd == -1) {
+        w->errors++;
+        return NULL;
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int seed = (MAX_THREADS + w->id) * ROUNDS + round; // Differs from the private phase so stale data shows up
+        w->errors += async_pass(fd, chunks, &owner, seed, 0);
+        w->errors += async_pass(fd, chunks, &owner, seed, 1);
+        w->bytes += 2LL * FILE_SIZE;
+    }
+
+    w->end = now();
+    fs_close(fd);
+    pthread_mutex_lock(&callback_lock);
+    w->errors += owner.errors;
+    pthread_mutex_unlock(&callback_lock);
+    return NULL;
+}
+
+int write_pattern(const char *name, int seed, int pos, int size) { // Write size bytes of the pattern for seed at pos, creating the file if needed
+    char buf[CHUNK_SIZE];
+    fs_create(name);
+    int fd = fs_open(name);
+    if (fd == -1 || fs_lseek(fd, pos) == -1) {
+        return -1;
+    }
+    int done = 0;
+    while (done < size) {
+        int len = (size - done < CHUNK_SIZE) ? size - done : CHUNK_SIZE;
+        for (int i = 0; i < len; i++) {
+            buf[i] = pattern_byte(seed, pos + done + i);
+        }
+        if (fs_write(fd, buf, len) != len) {
+            break; // Disk full
+        }
+        done += len;
+    }
+    return (fs_close(fd) == -1) ? -1 : done;
+}
+
+int file_size(const char *name) { // Size of a file, -1 if it does not exist
+    int fd = fs_open(name);
+    if (fd == -1) {
+        return -1;
+    }
+    int size = fs_get_filesize(fd);
+    fs_close(fd);
+    return size;
+}
+
+int check_file(const char *name, int seed, int size) { // Count errors in a file expected to hold size bytes of the pattern for seed
+    char buf[CHUNK_SIZE];
+    int fd = fs_open(name);
+    if (fd == -1 || fs_get_filesize(fd) != size) {
+        fs_close(fd);
+        return 1;
+    }
+    int errors = 0;
+    for (int pos = 0; pos < size; pos += CHUNK_SIZE) {
+        int len = (size - pos < CHUNK_SIZE) ? size - pos : CHUNK_SIZE;
+        if (fs_read(fd, buf, len) != len || check_chunk(buf, seed, pos, len) != 0) {
+            errors++;
+        }
+    }
+    fs_close(fd);
+    return errors;
+}
+
+int recovery_check(int options) { // Crash with the file system mounted, then check the contents and free space the remount recovers
+    int errors = 0;
+
+    // Space on an empty file system, to tell whether blocks leak through the recovery
+    if (make_fs(DISK_NAME) == -1 || mount_fs_options(DISK_NAME, options) == -1) {
+        return 1;
+    }
+    int capacity = write_pattern("fill", 0, 0, INT_MAX / 2);
+    if (umount_fs(DISK_NAME) == -1 || make_fs(DISK_NAME) == -1) {
+        return 1;
+    }
+
+    fflush(stdout); // The child must not print the parent's buffered output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        // "keep" and "shrink" on disk after a clean unmount
+        int ok = mount_fs_options(DISK_NAME, options) == 0
+                 && write_pattern("keep", 1, 0, FILE_SIZE) == FILE_SIZE
+                 && write_pattern("shrink", 2, 0, FILE_SIZE) == FILE_SIZE
+                 && umount_fs(DISK_NAME) == 0;
+        // "keep" rewritten in place and a small inline file added, both committed by fs_sync without allocating a block
+        ok = ok && mount_fs_options(DISK_NAME, options) == 0
+             && write_pattern("keep", 4, 0, FILE_SIZE) == FILE_SIZE
+             && write_pattern("small", 5, 0, CHUNK_SIZE / 32) == CHUNK_SIZE / 32
+             && fs_sync() == 0;
+        // Then changes the crash loses; the allocator starts from the first block after a mount,
+        // so "fresh" lands in the blocks the truncate freed if they are reused before a commit
+        int fd = fs_open("shrink");
+        ok = ok && fd != -1 && fs_truncate(fd, 0) == 0 && write_pattern("fresh", 3, 0, FILE_SIZE) == FILE_SIZE;
+        // Growing "keep" far enough evicts its committed indirect block to disk with pointers the committed bitmap calls free
+        ok = ok && write_pattern("keep", 4, FILE_SIZE, KEEP_GROWTH) == KEEP_GROWTH;
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE); // No umount_fs: the disk stays marked unclean
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        return 1;
+    }
+
+    // The first mount replays the journal and rebuilds the bitmap; the second follows a clean unmount
+    long long blocks_read[2] = {0, 0};
+    for (int pass = 0; pass < 2; pass++) {
+        long long calls, before, writes, written;
+        fs_get_io_stats(&calls, &before, &writes, &written);
+        if (mount_fs_options(DISK_NAME, options) == -1) {
+            return errors + 1;
+        }
+        fs_get_io_stats(&calls, &blocks_read[pass], &writes, &written);
+        blocks_read[pass] -= before;
+
+        // A background commit may have caught the changes after fs_sync, but never half of one operation
+        int shrink = file_size("shrink");
+        int fresh = file_size("fresh");
+        if (pass == 0) {
+            // Fill the disk, then grow "keep" into whatever blocks its indirect block still maps past its size; the
+            // rebuilt bitmap has to hold those back, or the growth lands in the fill file. A short fill means blocks leaked
+            int filled = write_pattern("fill", 0, 0, INT_MAX / 2);
+            write_pattern("keep", 4, file_size("keep"), KEEP_GROWTH);
+            int live = file_size("keep") + (shrink > 0 ? shrink : 0) + (fresh > 0 ? fresh : 0);
+            if (filled < 0 || capacity - filled - live > LEAK_SLACK * CHUNK_SIZE) {
+                errors++;
+            }
+            errors += check_file("fill", 0, filled);
+            if (fs_delete("fill") == -1) {
+                errors++;
+            }
+        }
+        int keep = file_size("keep");
+        errors += (keep < FILE_SIZE) ? 1 : check_file("keep", 4, keep);
+        errors += check_file("small", 5, CHUNK_SIZE / 32);
+        errors += (shrink == 0) ? 0 : check_file("shrink", 2, FILE_SIZE);
+        errors += (fresh == -1) ? 0 : check_file("fresh", 3, fresh);
+        if (umount_fs(DISK_NAME) == -1) {
+            errors++;
+        }
+    }
+    if (blocks_read[1] >= blocks_read[0]) {
+        errors++; // The clean mount should skip recovery and read less
+    }
+
+    printf("%-8s %-5s errors=%d\n", "recovery", (options & FS_MOUNT_MMAP) ? "mmap" : "disk", errors);
+    return errors;
+}
+
+int run_phase(const char *name, void *(*fn)(void *), int threads) { // Run one phase and print its throughput
+    struct Worker workers[MAX_THREADS];
+    long long bytes = 0;
+    int errors = 0;
+
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].errors = 0;
+        workers[i].bytes = 0;
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier); // Release the threads once every one has its descriptor
+    double start = 0, end = 0; // Earliest start and latest finish over all threads
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+        if (i == 0 || workers[i].start < start) {
+            start = workers[i].start;
+        }
+        if (i == 0 || workers[i].end > end) {
+            end = workers[i].end;
+        }
+    }
+    double elapsed = end - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("%-8s %-5s threads=%-3d %8.1f MB/s  errors=%d\n", name, backend_name, threads, bytes / elapsed / (1024 * 1024), errors);
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "max_threads must be between 1 and %d\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+
+    // Forks, so it runs before this process starts any threads of its own
+    int errors = recovery_check(0) + recovery_check(FS_MOUNT_MMAP);
+
+    if (make_fs(DISK_NAME) == -1 || mount_fs(DISK_NAME) == -1) {
+        fprintf(stderr, "ERROR: cannot create file system on %s\n", DISK_NAME);
+        return EXIT_FAILURE;
+    }
+
+    // One private file per thread plus a shared file written once up front
+    char name[16];
+    for (int i = 0; i < max_threads; i++) {
+        snprintf(name, sizeof(name), "t%d", i);
+        fs_create(name);
+    }
+    fs_create("shared");
+    int fd = fs_open("shared");
+    char buf[CHUNK_SIZE];
+    for (int pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE) {
+        for (int i = 0; i < CHUNK_SIZE; i++) {
+            buf[i] = pattern_byte(0, pos + i);
+        }
+        fs_write(fd, buf, CHUNK_SIZE);
+    }
+    fs_close(fd);
+
+    // disk.h serializes every block transfer, which hides lock contention; the mapping does not
+    for (int mmap_backend = 0; mmap_backend <= 1; mmap_backend++) {
+        backend_name = mmap_backend ? "mmap" : "disk";
+        if (mmap_backend && mount_fs_options(DISK_NAME, FS_MOUNT_MMAP) == -1) {
+            fprintf(stderr, "ERROR: cannot mount %s with FS_MOUNT_MMAP\n", DISK_NAME);
+            errors++;
+            break;
+        }
+
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            errors += run_phase("private", private_worker, threads);
+            errors += run_phase("shared", shared_worker, threads);
+            errors += run_phase("async", submit_worker, threads);
+        }
+
+        if (umount_fs(DISK_NAME) == -1) {
+            fprintf(stderr, "ERROR: cannot unmount %s\n", DISK_NAME);
+            errors++;
+            break;
+        }
+    }
+    remove(DISK_NAME);
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 //header files
+#define _GNU_SOURCE //for pipe2
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +8,139 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
-#define MAX_LINE_LENGTH 512 //maximum length of an input line
-#define MAX_NUM_TOKENS 32 //maximum number of tokens in a command
+extern char **environ; //environment handed to spawned commands
+
+#define MAX_JOB_TEXT 512 //characters of a command line kept for the job listings
+#define MAX_PIPELINE_LENGTH 32 //commands in one pipeline
+#define ARENA_BLOCK_SIZE 4096 //bytes the line arena grows by, unless a single allocation needs more
+#define MAX_JOBS 64 //size of the job table
+#define DEFAULT_MAX_BACKGROUND_JOBS 32 //background jobs allowed to run at once unless -b says otherwise
+#define BATCH_WINDOW 1024 //batch commands that can finish ahead of an earlier one still running, their output held back
+#define BATCH_FD_RESERVE 16 //descriptors the batch window leaves free for the shell itself, pipes and builtin redirections
+#define PATH_CACHE_SIZE 64 //buckets of the command path cache
+#define DEFAULT_PATH "/bin:/usr/bin" //searched when PATH is not set, as execvp does
+
+//a chunk of the line arena
+struct arena_block {
+    struct arena_block *next; //the block used after this one fills up
+    size_t size; //bytes in data
+    size_t used; //bytes handed out since the arena was last reset
+    char data[]; //starts pointer aligned, after the three fields above
+};
+
+//memory for everything parsed out of one command line. allocating just moves a pointer, and arena_reset releases the whole line
+//at once; the blocks are kept for the next line, so a shell that has warmed up parses without calling malloc
+struct arena {
+    struct arena_block *first; //NULL until the first allocation
+    struct arena_block *current; //the block allocations come from
+};
+
+//one command of a pipeline, a node of the parsed line; it lives in the line arena
+struct command {
+    char **argv; //the command name and its arguments, ended with a NULL pointer
+    int argc; //arguments in argv, the command name included
+    char *input_file; //file named after <, NULL if there is none
+    char *output_file; //file named after >, NULL if there is none
+    struct command *next; //the command this one pipes into, NULL for the last
+};
+
+//a parsed command line; it lives in the line arena
+struct pipeline {
+    struct command *first; //the commands in pipeline order, NULL for a blank line
+    int num_commands; //commands in the list
+    int background; //non-zero if the line ends with &
+    char *text; //the line as typed, without the newline
+    const char *error; //why the line could not be parsed, NULL if it could
+};
+
+//a word of a command being parsed, before the command's argv array is built
+struct word {
+    char *text;
+    struct word *next;
+};
+
+//what the tokenizer found next in the line
+enum token_type {
+    TOKEN_WORD,
+    TOKEN_INPUT, //<
+    TOKEN_OUTPUT, //>
+    TOKEN_PIPE, //|
+    TOKEN_BACKGROUND, //&
+    TOKEN_END, //end of the line, or a comment
+    TOKEN_UNTERMINATED, //a quote that is never closed
+};
+
+//the tokenizer's position in the line
+struct lexer {
+    char *pos; //next character to look at
+    char pending; //an operator whose character was overwritten to end the word before it, 0 if none
+};
+
+//a pipeline the shell started; it stays in the job table until it has finished and, for background jobs, been reported.
+//the SIGCHLD handler updates running, stopped and status, so the rest of the shell only touches a job with SIGCHLD blocked
+struct job {
+    int in_use; //non-zero if this slot holds a job
+    int background; //non-zero if the shell is not waiting for the job
+    int sequence; //when the job was started or last stopped, from job_sequence; the highest one is the current job
+    pid_t pgid; //process group of the job's commands, 0 when they stay in the shell's group because there is no job control
+    pid_t pids[MAX_PIPELINE_LENGTH]; //pid of each command, 0 once it has been reaped
+    int num_pids; //commands started
+    pid_t last_pid; //the last command of the pipeline, whose exit code is the job's
+    int running; //commands not reaped yet
+    int stopped; //non-zero if a command was stopped and the job has not been continued since
+    int status; //exit code of the last command once it has finished
+    struct timespec started; //when the first command was started
+    struct timespec finished; //when the last command was reaped
+    char command[MAX_JOB_TEXT]; //the command line, for jobs and the done and stopped messages
+};
+
+//a line of a batch script (-j); entries are printed in script order once the command and every earlier one have finished
+struct batch_entry {
+    int line_number; //line of the script
+    struct job *job; //the running job, NULL once it has finished
+    FILE *out; //the command's buffered stdout
+    FILE *err; //the command's buffered stderr
+    int done; //non-zero once status and seconds are known
+    int status; //exit code
+    double seconds; //wall time
+    char *command; //the command line, for the report
+};
+
+//a command found on PATH, remembered so the next run does not search PATH again; see hash
+struct path_entry {
+    char *name; //the command name as typed
+    char *path; //where it was found
+    int hits; //times the entry was used
+    struct path_entry *next; //next entry in the same bucket
+};
+
+//a command the shell runs itself instead of starting a process
+struct builtin {
+    const char *name;
+    int (*run)(char *argv[]); //returns the exit code
+};
+
+int terminal_fd = -1; //the terminal the shell hands to foreground pipelines, -1 when not running interactively on a terminal
+struct job jobs[MAX_JOBS]; //job table; a job's id is its index plus one
+int max_background_jobs = DEFAULT_MAX_BACKGROUND_JOBS; //background jobs allowed to run at once, set with -b
+sigset_t sigchld_set; //just SIGCHLD, for blocking it around job table changes
+struct batch_entry batch[BATCH_WINDOW]; //batch commands not printed yet, used as a ring
+int batch_head; //oldest entry not printed yet
+int batch_tail; //where the next entry goes; entries batch_head to batch_tail - 1 are in use
+int batch_window; //entries allowed in use at once, at most BATCH_WINDOW and fewer when the descriptor limit is low
+int batch_running; //batch commands still running
+int batch_failures; //batch commands that exited with a non-zero code
+struct path_entry *path_cache[PATH_CACHE_SIZE]; //commands found on PATH, hashed by name; emptied when PATH changes
+int last_status; //exit code of the last command line, or in batch mode of the last line printed; for exit without an argument and the shell's own exit code
+int exit_requested; //set by the exit builtin; the shell stops reading commands
+int job_sequence; //counts jobs started and stopped, for picking the current job
+struct arena line_arena; //the parsed line being run; reset before the next line is parsed
 
 //this function checks the return value of system calls, if return value is -1, the perror message is printed and the program exits with failure status
 void check_sys_call(int ret, char* msg) { 
@@ -20,139 +151,1298 @@ void check_sys_call(int ret, char* msg) {
 }
 
 
-//this function parses the input line into tokens, it takes the input line and creates an array called token to store the parsed tokens
-void parse_input(char *line, char *tokens[]) {
-    char *token;
-    int token_count = 0;
+//this function hands out size bytes of the arena, pointer aligned; they stay valid until the arena is reset
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (arena->current == NULL) {
+        arena->first = arena->current = calloc(1, sizeof(struct arena_block) + ARENA_BLOCK_SIZE);
+        if (arena->current == NULL) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        arena->current->size = ARENA_BLOCK_SIZE;
+    }
+    while (arena->current->used + size > arena->current->size) { //move on to the next block, adding one at the end if need be
+        if (arena->current->next == NULL) {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            arena->current->next = calloc(1, sizeof(struct arena_block) + block_size);
+            if (arena->current->next == NULL) {
+                perror("malloc failed");
+                exit(EXIT_FAILURE);
+            }
+            arena->current->next->size = block_size;
+        }
+        arena->current = arena->current->next;
+        arena->current->used = 0; //left over from an earlier line
+    }
+    void *memory = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return memory;
+}
+
 
-    token = strtok(line, " \n"); // this function will tokenize the input line (split it) based on whitespaces and newline characters
-    while (token != NULL && token_count < MAX_NUM_TOKENS - 1) {
-        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0 || strcmp(token, "|") == 0 || strcmp(token, "&") == 0) {
-            tokens[token_count++] = strdup(token); // it checks each token for special characters and copies them into the token array
+//this function releases everything allocated from the arena in one step; the blocks are kept for reuse
+void arena_reset(struct arena *arena) {
+    arena->current = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+}
+
+
+//this function tells whether a character ends an unquoted word: whitespace, an operator, or the end of the line
+int ends_word(char c) {
+    switch (c) {
+    case '\0': case ' ': case '\t': case '\n': case '\r': case '<': case '>': case '|': case '&':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+//this function returns the next token of the line. it copies nothing: a word is unquoted in place, in the line itself, and *word
+//points at it. quote removal only ever shortens a word, so the characters written never overtake the ones still to be read.
+//'single quotes' keep everything, "double quotes" keep everything but a backslash before " \ $ or `, a backslash outside quotes
+//keeps the next character, and a # at the start of a word comments out the rest of the line
+enum token_type next_token(struct lexer *lexer, char **word) {
+    if (lexer->pending != '\0') {
+        char op = lexer->pending;
+        lexer->pending = '\0';
+        return op == '<' ? TOKEN_INPUT : op == '>' ? TOKEN_OUTPUT : op == '|' ? TOKEN_PIPE : TOKEN_BACKGROUND;
+    }
+
+    char *pos = lexer->pos;
+    while (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r') {
+        pos++;
+    }
+    lexer->pos = pos + 1;
+    switch (*pos) {
+    case '\0':
+    case '#':
+        lexer->pos = pos;
+        return TOKEN_END;
+    case '<':
+        return TOKEN_INPUT;
+    case '>':
+        return TOKEN_OUTPUT;
+    case '|':
+        return TOKEN_PIPE;
+    case '&':
+        return TOKEN_BACKGROUND;
+    }
+
+    char *out = pos; //where the next character of the unquoted word goes
+    *word = pos;
+    while (!ends_word(*pos)) {
+        if (*pos == '\'') {
+            for (pos++; *pos != '\'' && *pos != '\0'; pos++) {
+                *out++ = *pos;
+            }
+            if (*pos++ == '\0') {
+                return TOKEN_UNTERMINATED;
+            }
+        } else if (*pos == '"') {
+            for (pos++; *pos != '"' && *pos != '\0'; pos++) {
+                if (*pos == '\\' && (pos[1] == '"' || pos[1] == '\\' || pos[1] == '$' || pos[1] == '`')) {
+                    pos++;
+                }
+                *out++ = *pos;
+            }
+            if (*pos++ == '\0') {
+                return TOKEN_UNTERMINATED;
+            }
+        } else if (*pos == '\\') {
+            pos++;
+            if (*pos == '\n') {
+                pos++; //an escaped newline just ends the line
+            } else if (*pos != '\0') {
+                *out++ = *pos++;
+            }
         } else {
-            tokens[token_count++] = token;
+            *out++ = *pos++;
         }
-        token = strtok(NULL, " \n"); 
     }
-    tokens[token_count] = NULL; //the tokens array is ended with a null pointer
+
+    //the word needs a terminating NUL. quotes removed leave room for it; otherwise it goes over the character after the word,
+    //which is remembered if it is an operator
+    if (out == pos && *pos != '\0') {
+        if (*pos != ' ' && *pos != '\t' && *pos != '\n' && *pos != '\r') {
+            lexer->pending = *pos;
+        }
+        pos++;
+    }
+    *out = '\0';
+    lexer->pos = pos;
+    return TOKEN_WORD;
 }
 
 
-//this function is responsible for executing the parsed command;  handles input/output redirection, piping, and running commands in the background
-void execute_command(char *tokens[]) {
-    if (tokens[0] == NULL) {
-        fprintf(stderr, "ERROR: No command provided\n"); //checks if firsts token is NULL; if so no command was provided so error is printed and returns
-        return;
+//this function gives a parsed command its argv array, built from the words collected for it
+void finish_command(struct arena *arena, struct command *cmd, struct word *words) {
+    cmd->argv = arena_alloc(arena, (cmd->argc + 1) * sizeof(char *));
+    for (int i = 0; i < cmd->argc; i++, words = words->next) {
+        cmd->argv[i] = words->text;
+    }
+    cmd->argv[cmd->argc] = NULL;
+}
+
+
+//this function parses a command line of any length into a pipeline: its commands, their arguments and redirections, and whether it
+//runs in the background. every node is allocated from the arena and the words point into line, which the parse changes and which
+//must outlive the pipeline. a malformed line gives a pipeline with error set
+struct pipeline *parse_line(struct arena *arena, char *line) {
+    struct pipeline *pipeline = arena_alloc(arena, sizeof(*pipeline));
+    memset(pipeline, 0, sizeof(*pipeline));
+
+    size_t length = strlen(line); //the text is copied first, as the words are unquoted over the line
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        length--;
+    }
+    pipeline->text = arena_alloc(arena, length + 1);
+    memcpy(pipeline->text, line, length);
+    pipeline->text[length] = '\0';
+
+    struct lexer lexer = {line, '\0'};
+    struct command **link = &pipeline->first; //where the next command is linked in
+    struct command *cmd = NULL; //the command being parsed, NULL before its first token
+    struct word *words = NULL; //its words so far
+    struct word **word_link = &words;
+    char *word;
+    enum token_type type;
+
+    while ((type = next_token(&lexer, &word)) != TOKEN_END) {
+        if (type == TOKEN_UNTERMINATED) {
+            pipeline->error = "Unterminated quote";
+            return pipeline;
+        }
+        if (pipeline->background) { //& ends the line
+            pipeline->error = "Invalid command";
+            return pipeline;
+        }
+        if (cmd == NULL) {
+            if (pipeline->num_commands == MAX_PIPELINE_LENGTH) {
+                pipeline->error = "Too many commands in a pipeline";
+                return pipeline;
+            }
+            cmd = arena_alloc(arena, sizeof(*cmd));
+            memset(cmd, 0, sizeof(*cmd));
+            *link = cmd;
+            link = &cmd->next;
+            pipeline->num_commands++;
+            words = NULL;
+            word_link = &words;
+        }
+
+        if (type == TOKEN_WORD) {
+            struct word *node = arena_alloc(arena, sizeof(*node));
+            node->text = word;
+            node->next = NULL;
+            *word_link = node;
+            word_link = &node->next;
+            cmd->argc++;
+        } else if (type == TOKEN_INPUT || type == TOKEN_OUTPUT) { //the next token names the file
+            enum token_type file_type = next_token(&lexer, &word);
+            if (file_type != TOKEN_WORD) {
+                pipeline->error = file_type == TOKEN_UNTERMINATED ? "Unterminated quote" : "Invalid command";
+                return pipeline;
+            }
+            if (type == TOKEN_INPUT) {
+                cmd->input_file = word;
+            } else {
+                cmd->output_file = word;
+            }
+        } else if (type == TOKEN_PIPE) { //the current command is complete, start the next one
+            if (cmd->argc == 0) {
+                pipeline->error = "Invalid command";
+                return pipeline;
+            }
+            finish_command(arena, cmd, words);
+            cmd = NULL;
+        } else {
+            pipeline->background = 1;
+        }
+    }
+
+    if (cmd == NULL) {
+        if (pipeline->num_commands > 0) { //a pipe with nothing after it
+            pipeline->error = "Invalid command";
+        }
+        return pipeline;
+    }
+    if (cmd->argc == 0) {
+        pipeline->error = "Invalid command";
+        return pipeline;
+    }
+    finish_command(arena, cmd, words);
+    return pipeline;
+}
+
+
+//this function hashes a command name for the path cache
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 5381;
+    for (; *name != '\0'; name++) {
+        hash = hash * 33 + (unsigned char)*name;
+    }
+    return hash % PATH_CACHE_SIZE;
+}
+
+
+//this function empties the path cache; it is called whenever PATH changes, since every entry may now be the wrong file
+void clear_path_cache() {
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        while (path_cache[i] != NULL) {
+            struct path_entry *entry = path_cache[i];
+            path_cache[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+
+//this function drops one command from the path cache, so the next run searches PATH for it again
+void forget_command(const char *name) {
+    for (struct path_entry **link = &path_cache[hash_name(name)]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            struct path_entry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+    }
+}
+
+
+//this function searches the directories of PATH for an executable file called name, it returns the full path in memory
+//the caller frees, or NULL if there is none. an empty directory in PATH means the current directory, as with execvp
+char *search_path(const char *name) {
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL) {
+        dirs = DEFAULT_PATH;
+    }
+    while (1) {
+        const char *end = strchr(dirs, ':');
+        int dir_length = end != NULL ? (int)(end - dirs) : (int)strlen(dirs);
+        char *path = malloc(dir_length + strlen(name) + 2);
+        if (path == NULL) {
+            return NULL;
+        }
+        if (dir_length == 0) {
+            strcpy(path, name);
+        } else {
+            sprintf(path, "%.*s/%s", dir_length, dirs, name);
+        }
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            return path;
+        }
+        free(path);
+        if (end == NULL) {
+            return NULL;
+        }
+        dirs = end + 1;
     }
+}
+
 
+//this function finds the file a command name runs, like bash's command hashing: PATH is only searched the first time a name is
+//used, after that the path cache answers. a name with a slash in it is a path already. it returns NULL if the command is not found
+const char *find_command(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    unsigned int bucket = hash_name(name);
+    for (struct path_entry *entry = path_cache[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
 
-    // declaration of variables: flags are to indicate if a pipe or background exec is requested
-    int pipe_flag = 0;
-    int background_flag = 0;
+    char *path = search_path(name);
+    struct path_entry *entry = malloc(sizeof(*entry));
+    if (path == NULL || entry == NULL) {
+        free(path);
+        free(entry);
+        return NULL; //misses are not cached: the command may be installed before the next try
+    }
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = path_cache[bucket];
+    path_cache[bucket] = entry;
+    return path;
+}
 
-    int num_commands = 1; // counts number of commands/pipelines to be exec
-    int command_index[MAX_NUM_TOKENS]; // stores the number of tokens in array
-    int pipe_fd[2]; //file descripters for the pipe.
 
-    for (int i = 0; tokens[i] != NULL; i++) { //this loop iterates through the pipes to indetify pipe and background requests and stores the index of next command to array.
-        if (strcmp(tokens[i], "|") == 0) {
-            pipe_flag = 1;
-            num_commands++;
-            command_index[num_commands - 1] = i + 1;
-        } else if (strcmp(tokens[i], "&") == 0) {
-            background_flag = 1;
+//fallback launcher for when posix_spawn is not available: forks a copy of the shell and sets up the redirections in the child before exec
+pid_t fork_command(struct command *cmd, const char *path, int in_fd, int out_fd, int err_fd, pid_t pgid) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid == -1) {
+            perror("fork failed");
+        } else if (terminal_fd != -1) {
+            setpgid(pid, pgid == 0 ? pid : pgid); //done in both processes so neither has to wait for the other
         }
+        return pid; // parent: the child's pid, or -1 if fork failed
     }
 
-    for (int i = 0; i < num_commands; i++) { //executes commands in the pipeline
-        pid_t pid; // forks child process for each command
-        int status;
+    if (terminal_fd != -1) {
+        setpgid(0, pgid);
+    }
+    signal(SIGTTOU, SIG_DFL); //the shell ignores these for itself
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
 
-        if (pipe_flag && i < num_commands - 1) {
-            check_sys_call(pipe(pipe_fd), "pipe failed"); //handles piping
+    if (in_fd != STDIN_FILENO) { //pipe ends are opened close-on-exec, so only the dup2 copies survive the exec
+        check_sys_call(dup2(in_fd, STDIN_FILENO), "dup2 failed");
+    }
+    if (out_fd != STDOUT_FILENO) {
+        check_sys_call(dup2(out_fd, STDOUT_FILENO), "dup2 failed");
+    }
+    if (err_fd != STDERR_FILENO) {
+        check_sys_call(dup2(err_fd, STDERR_FILENO), "dup2 failed");
+    }
+    if (cmd->input_file != NULL) { //a redirection wins over the pipe, like in other shells
+        int fd = open(cmd->input_file, O_RDONLY);
+        check_sys_call(fd, "open failed");
+        check_sys_call(dup2(fd, STDIN_FILENO), "dup2 failed");
+        close(fd);
+    }
+    if (cmd->output_file != NULL) {
+        int fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        check_sys_call(fd, "open failed");
+        check_sys_call(dup2(fd, STDOUT_FILENO), "dup2 failed");
+        close(fd);
+    }
+    execv(path, cmd->argv);
+    perror("execv failed");
+    _exit(127); //_exit so the child does not flush the shell's stdio buffers a second time
+}
+
+
+//this function starts one command with its stdin, stdout and stderr connected to in_fd, out_fd and err_fd and returns its pid, or -1 if it could not be started.
+//posix_spawn creates the child without copying the shell's page tables (glibc uses clone with CLONE_VM | CLONE_VFORK), and the pipe and file
+//redirections are described as file actions that run in the child between the clone and the exec.
+//with job control the child joins process group pgid, or starts a new group of its own if pgid is 0; without it the child stays in
+//the shell's group, so it can still read a terminal and ctrl-c reaches it with the shell. the program comes from the path cache, so
+//posix_spawn execs it straight away instead of posix_spawnp trying every directory of PATH in the child
+pid_t spawn_command(struct command *cmd, int in_fd, int out_fd, int err_fd, pid_t pgid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t default_signals; //signals the shell ignores that the command must not
+    sigset_t no_signals; //the command starts with nothing blocked, although the shell blocks SIGCHLD while it launches
+    pid_t pid;
+
+    const char *path = find_command(cmd->argv[0]);
+    if (path == NULL) {
+        dprintf(err_fd, "%s: command not found\n", cmd->argv[0]);
+        return -1;
+    }
+
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGTTOU);
+    sigaddset(&default_signals, SIGTTIN);
+    sigaddset(&default_signals, SIGTSTP);
+    sigemptyset(&no_signals);
+    int err = posix_spawnattr_init(&attr);
+    if (err == 0) {
+        posix_spawnattr_setflags(&attr, (terminal_fd != -1 ? POSIX_SPAWN_SETPGROUP : 0) | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigdefault(&attr, &default_signals);
+        posix_spawnattr_setsigmask(&attr, &no_signals);
+        err = posix_spawn_file_actions_init(&actions);
+        if (err != 0) {
+            posix_spawnattr_destroy(&attr);
+        }
+    }
+    if (err == 0) {
+        if (in_fd != STDIN_FILENO) {
+            err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+        }
+        if (err == 0 && out_fd != STDOUT_FILENO) {
+            err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
         }
+        if (err == 0 && err_fd != STDERR_FILENO) {
+            err = posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+        }
+        if (err == 0 && cmd->input_file != NULL) {
+            err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->input_file, O_RDONLY, 0);
+        }
+        if (err == 0 && cmd->output_file != NULL) {
+            err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        }
+        if (err == 0) {
+            err = posix_spawn(&pid, path, &actions, &attr, cmd->argv, environ);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+    }
+
+    if (err == ENOSYS) {
+        return fork_command(cmd, path, in_fd, out_fd, err_fd, pgid); //this system cannot spawn, so copy the shell instead
+    }
+    if (err == ENOENT) {
+        forget_command(cmd->argv[0]); //the file may have been moved since it was cached; search again next time
+    }
+    if (err != 0) {
+        dprintf(err_fd, "%s: %s\n", cmd->argv[0], strerror(err)); //command not found, or a redirection file could not be opened
+        return -1;
+    }
+    return pid;
+}
+
 
-        pid = fork(); //a new process is created by duplicating
-        check_sys_call(pid, "fork failed"); // checks if system is in failure or not and reports if so.
+//this function turns a wait status into an exit code the way other shells report it: the exit status, or 128 plus the signal number
+int exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return EXIT_FAILURE;
+}
 
-        //in this part, we execute the parent and child process. If pid is 0, it is the child process, else it is the parent
-        if (pid == 0) { //child
-            if (pipe_flag) { //if the there is a pipe needed, this part will check for the pipe flag. 
-                if (i == 0 && num_commands > 1) { // is its the first command in the pipeline and there are more than one command, the standard output is directed to the writend end of the pipe and the reading end is closed, this is of course checked for errors.
-                    check_sys_call(dup2(pipe_fd[1], STDOUT_FILENO), "dup2 failed"); 
-                    check_sys_call(close(pipe_fd[0]), "close failed");
-                } else if (i == num_commands - 1) { //if this is the last command in the pipeline, the standard input is directed to the reading end of the pipe and the writing end is closed since the command doesnt write to it.
-                    check_sys_call(dup2(pipe_fd[0], STDIN_FILENO), "dup2 failed");
-                    check_sys_call(close(pipe_fd[1]), "close failed");
-                } else { // any commands in the middle of the pipeline have their standard inputs and outputs directed to the corresponding ends; reading end to stdin and writng to stdout. AGAIN ALL ARE CHECKED.
-                    check_sys_call(dup2(pipe_fd[0], STDIN_FILENO), "dup2 failed");
-                    check_sys_call(dup2(pipe_fd[1], STDOUT_FILENO), "dup2 failed");
+
+//SIGCHLD handler: reaps every child that has finished and records stops, without blocking. it only touches the job table,
+//which the rest of the shell changes with SIGCHLD blocked
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno; //waitpid must not disturb an errno the interrupted code is about to look at
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            struct job *job = &jobs[i];
+            for (int k = 0; job->in_use && k < job->num_pids; k++) {
+                if (job->pids[k] != pid) {
+                    continue;
+                }
+                if (WIFSTOPPED(status)) {
+                    job->stopped = 1;
+                } else {
+                    job->pids[k] = 0;
+                    job->running--;
+                    if (pid == job->last_pid) {
+                        job->status = exit_code(status);
+                    }
+                    if (job->running == 0) {
+                        clock_gettime(CLOCK_MONOTONIC, &job->finished); //async-signal-safe, unlike most of libc
+                    }
                 }
             }
-            //this part handles the redirection using the <,> symbols
-            if (strcmp(tokens[i], "<") == 0) { //this checks if the tokens have <, they are for reading
-                int fd = open(tokens[i + 1], O_RDONLY); // it opens the file for reading only
-                check_sys_call(fd, "open failed");//checks if the opening worked
-                check_sys_call(dup2(fd, STDIN_FILENO), "dup2 failed");//duplicates the file descriptor to the input file descriptor and redirects the standard input to the specificed file
-                close(fd);
-                i++;
-            } else if (strcmp(tokens[i], ">") == 0) { // if the token has the < symbol; they are for writing
-                int fd = open(tokens[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0666); // it opens the file for writing only, creates it if it doesnt exist, or makes it zero lenght if it does and sets permissions to 0666 for unix file creation or modification
-                check_sys_call(fd, "open failed");//it chekcs if the file opened right
-                check_sys_call(dup2(fd, STDOUT_FILENO), "dup2 failed"); // duplicate the file descriptor onto the standard output file descriptor
-                close(fd);
-                i++;
-            }
-            execvp(tokens[command_index[i]], &tokens[command_index[i]]); //this step executes the command regardless of whether the input/output redirection was performed
-            perror("execvp failed"); // if the above step fails, this reads out the error message.
-            exit(EXIT_FAILURE);
-        } else { //after forkingthe child process, this handles the behavior of the parent process
-            if (background_flag && i == num_commands - 1) { //if the command is the last command and has a background flag, the loop is broken to ensure the parent process doesnt wait for the background command to finish if its the last command.
+        }
+    }
+    errno = saved_errno;
+}
+
+
+//this function waits until a job has finished or stopped; the caller has SIGCHLD blocked, and sigsuspend lets the handler in while waiting
+void wait_for_job(struct job *job) {
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    while (job->running > 0 && !job->stopped) {
+        sigsuspend(&mask);
+    }
+}
+
+
+//this function counts background jobs that are still running; stopped ones do not count against the cap
+int count_background_jobs() {
+    int count = 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].in_use && jobs[i].background && jobs[i].running > 0 && !jobs[i].stopped) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+//this function prints a job the way the jobs builtin lists it
+void print_job(struct job *job) {
+    const char *state = job->running == 0 ? "Done" : job->stopped ? "Stopped" : "Running";
+    printf("[%d]  %-8s %s\n", (int)(job - jobs) + 1, state, job->command);
+}
+
+
+//this function frees background jobs that have finished, printing them first when the shell is interactive; SIGCHLD must be blocked
+void report_finished_jobs(int print) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].in_use && jobs[i].background && jobs[i].running == 0) {
+            if (print) {
+                print_job(&jobs[i]);
+            }
+            jobs[i].in_use = 0;
+        }
+    }
+}
+
+
+//this function finds a job from a builtin's argument: a job id, optionally written as %n. without an argument it picks the current
+//job, the one started or stopped most recently; ids are reused, so the highest one is not necessarily the newest
+struct job *find_job(char *arg) {
+    if (arg == NULL) {
+        struct job *current = NULL;
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].in_use && jobs[i].background && (current == NULL || jobs[i].sequence > current->sequence)) {
+                current = &jobs[i];
+            }
+        }
+        if (current == NULL) {
+            fprintf(stderr, "no current job\n");
+        }
+        return current;
+    }
+    int id = atoi(arg[0] == '%' ? arg + 1 : arg);
+    if (id < 1 || id > MAX_JOBS || !jobs[id - 1].in_use || !jobs[id - 1].background) {
+        fprintf(stderr, "%s: no such job\n", arg);
+        return NULL;
+    }
+    return &jobs[id - 1];
+}
+
+
+//this function sends SIGCONT to a job's commands: to its process group, or to each command still running when it has none
+void continue_job(struct job *job) {
+    if (job->pgid != 0) {
+        kill(-job->pgid, SIGCONT);
+        return;
+    }
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->pids[i] != 0) {
+            kill(job->pids[i], SIGCONT);
+        }
+    }
+}
+
+
+//this function runs a job in the foreground until it finishes or stops, and returns its exit code; SIGCHLD must be blocked
+int foreground_job(struct job *job) {
+    job->background = 0;
+    if (terminal_fd != -1) {
+        //a foreground job owns the terminal, so ctrl-c and ctrl-z reach it and not the shell. a command that touched the
+        //terminal before this point was stopped with SIGTTIN or SIGTTOU, and SIGCONT lets it carry on
+        tcsetpgrp(terminal_fd, job->pgid);
+    }
+    if (job->stopped || terminal_fd != -1) {
+        job->stopped = 0;
+        continue_job(job);
+    }
+
+    wait_for_job(job);
+
+    if (terminal_fd != -1) {
+        tcsetpgrp(terminal_fd, getpgrp()); //takes the terminal back for the prompt
+    }
+    if (job->stopped) { //ctrl-z: the job waits in the table for fg or bg
+        job->background = 1;
+        job->sequence = ++job_sequence; //like other shells, the job just stopped becomes the current one
+        printf("\n[%d]+ Stopped  %s\n", (int)(job - jobs) + 1, job->command);
+        return 128 + SIGTSTP;
+    }
+    if (terminal_fd != -1 && job->status == 128 + SIGINT) {
+        printf("\n"); //ctrl-c leaves the cursor after ^C
+    }
+    job->in_use = 0;
+    return job->status;
+}
+
+
+//builtin jobs: lists the background jobs
+int builtin_jobs(char *argv[]) {
+    (void)argv;
+    sigset_t saved_mask; //SIGCHLD may already be blocked, as in batch mode, and must stay that way
+    sigprocmask(SIG_BLOCK, &sigchld_set, &saved_mask);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].in_use && jobs[i].background) {
+            print_job(&jobs[i]);
+        }
+    }
+    report_finished_jobs(0); //those just listed as done are gone now
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    return EXIT_SUCCESS;
+}
+
+
+//builtin wait [n]: waits for job n, or for every running background job, and returns the job's exit code
+int builtin_wait(char *argv[]) {
+    int ret = EXIT_SUCCESS;
+    sigset_t saved_mask;
+    sigprocmask(SIG_BLOCK, &sigchld_set, &saved_mask);
+    if (argv[1] != NULL) {
+        struct job *job = find_job(argv[1]);
+        if (job == NULL) {
+            ret = 127;
+        } else {
+            wait_for_job(job);
+            ret = job->stopped ? 128 + SIGTSTP : job->status;
+        }
+    } else {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].in_use && jobs[i].background) {
+                wait_for_job(&jobs[i]);
+            }
+        }
+    }
+    report_finished_jobs(0);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    return ret;
+}
+
+
+//builtin fg [n]: continues a background or stopped job in the foreground
+int builtin_fg(char *argv[]) {
+    int ret = EXIT_FAILURE;
+    sigset_t saved_mask;
+    sigprocmask(SIG_BLOCK, &sigchld_set, &saved_mask);
+    struct job *job = find_job(argv[1]);
+    if (job != NULL) {
+        printf("%s\n", job->command);
+        fflush(stdout);
+        ret = foreground_job(job);
+    }
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    return ret;
+}
+
+
+//builtin bg [n]: lets a stopped job carry on in the background
+int builtin_bg(char *argv[]) {
+    int ret = EXIT_FAILURE;
+    sigset_t saved_mask;
+    sigprocmask(SIG_BLOCK, &sigchld_set, &saved_mask);
+    struct job *job = find_job(argv[1]);
+    if (job != NULL) {
+        job->stopped = 0;
+        continue_job(job);
+        printf("[%d]+ %s &\n", (int)(job - jobs) + 1, job->command);
+        ret = EXIT_SUCCESS;
+    }
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    return ret;
+}
+
+
+//builtin cd [dir]: changes the shell's directory to dir, to HOME without one, or back to the previous one with -
+int builtin_cd(char *argv[]) {
+    const char *dir = argv[1];
+    if (dir == NULL) {
+        dir = getenv("HOME");
+    } else if (strcmp(dir, "-") == 0) {
+        dir = getenv("OLDPWD");
+    }
+    if (dir == NULL) {
+        fprintf(stderr, "cd: %s not set\n", argv[1] == NULL ? "HOME" : "OLDPWD");
+        return EXIT_FAILURE;
+    }
+
+    char *old_dir = getcwd(NULL, 0);
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        free(old_dir);
+        return EXIT_FAILURE;
+    }
+    char *new_dir = getcwd(NULL, 0);
+    if (old_dir != NULL) {
+        setenv("OLDPWD", old_dir, 1);
+    }
+    if (new_dir != NULL) {
+        setenv("PWD", new_dir, 1);
+        if (argv[1] != NULL && strcmp(argv[1], "-") == 0) {
+            printf("%s\n", new_dir);
+        }
+    }
+    free(old_dir);
+    free(new_dir);
+    return EXIT_SUCCESS;
+}
+
+
+//builtin exit [n]: makes the shell stop with exit code n, or with the last command's exit code
+int builtin_exit(char *argv[]) {
+    int ret = last_status;
+    if (argv[1] != NULL) {
+        char *end;
+        ret = (int)strtol(argv[1], &end, 10) & 0xff;
+        if (*argv[1] == '\0' || *end != '\0') {
+            fprintf(stderr, "exit: %s: numeric argument required\n", argv[1]);
+            ret = 2;
+        }
+    }
+    exit_requested = 1;
+    return ret;
+}
+
+
+//builtin export [name=value ...]: sets environment variables for the commands the shell starts, or lists them without an argument.
+//setting PATH empties the path cache
+int builtin_export(char *argv[]) {
+    int ret = EXIT_SUCCESS;
+    if (argv[1] == NULL) {
+        for (char **var = environ; *var != NULL; var++) {
+            printf("export %s\n", *var);
+        }
+        return ret;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        char *equals = strchr(argv[i], '=');
+        int name_length = equals != NULL ? (int)(equals - argv[i]) : (int)strlen(argv[i]);
+        int valid = name_length > 0 && (argv[i][0] < '0' || argv[i][0] > '9');
+        for (int k = 0; k < name_length; k++) {
+            char c = argv[i][k];
+            if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) {
+                valid = 0;
+            }
+        }
+        if (!valid) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        if (equals == NULL) {
+            continue; //every variable the shell has is in the environment already
+        }
+        *equals = '\0';
+        setenv(argv[i], equals + 1, 1);
+        if (strcmp(argv[i], "PATH") == 0) {
+            clear_path_cache();
+        }
+        *equals = '=';
+    }
+    return ret;
+}
+
+
+//builtin echo [-n] [word ...]: prints the words separated by spaces, and a newline unless -n is given
+int builtin_echo(char *argv[]) {
+    int i = 1;
+    int newline = 1;
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; argv[i] != NULL; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        fputs(argv[i], stdout);
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return EXIT_SUCCESS;
+}
+
+
+//builtin pwd: prints the shell's current directory
+int builtin_pwd(char *argv[]) {
+    (void)argv;
+    char *dir = getcwd(NULL, 0);
+    if (dir == NULL) {
+        perror("pwd");
+        return EXIT_FAILURE;
+    }
+    printf("%s\n", dir);
+    free(dir);
+    return EXIT_SUCCESS;
+}
+
+
+//builtin true: does nothing, successfully
+int builtin_true(char *argv[]) {
+    (void)argv;
+    return EXIT_SUCCESS;
+}
+
+
+//builtin false: does nothing, unsuccessfully
+int builtin_false(char *argv[]) {
+    (void)argv;
+    return EXIT_FAILURE;
+}
+
+
+//builtin hash [-r] [name ...]: lists the path cache, empties it with -r, or looks the names up and adds them
+int builtin_hash(char *argv[]) {
+    int ret = EXIT_SUCCESS;
+    if (argv[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+            for (struct path_entry *entry = path_cache[i]; entry != NULL; entry = entry->next) {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return ret;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            clear_path_cache();
+        } else if (find_command(argv[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            ret = EXIT_FAILURE;
+        }
+    }
+    return ret;
+}
+
+
+struct builtin builtins[] = {
+    {"jobs", builtin_jobs},
+    {"wait", builtin_wait},
+    {"fg", builtin_fg},
+    {"bg", builtin_bg},
+    {"cd", builtin_cd},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"echo", builtin_echo},
+    {"pwd", builtin_pwd},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"hash", builtin_hash},
+    {NULL, NULL},
+};
+
+
+//this function looks a command name up in the builtin table, it returns NULL if the command is not a builtin
+struct builtin *find_builtin(const char *name) {
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+
+//this function runs a builtin inside the shell with its stdout sent to out_fd, or to the file named after >, and its stderr to err_fd.
+//builtins never read stdin, so a < file is ignored
+int run_builtin(struct builtin *builtin, struct command *cmd, int out_fd, int err_fd) {
+    int file_fd = -1;
+    if (cmd->output_file != NULL) {
+        file_fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (file_fd == -1) {
+            dprintf(err_fd, "%s: %s\n", cmd->output_file, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        out_fd = file_fd;
+    }
+    if (out_fd == STDOUT_FILENO && err_fd == STDERR_FILENO) {
+        return builtin->run(cmd->argv);
+    }
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    if (saved_stdout == -1 || saved_stderr == -1) { //out of descriptors; the builtin fails instead of taking the shell down
+        dprintf(err_fd, "dup failed: %s\n", strerror(errno));
+        if (saved_stdout != -1) {
+            close(saved_stdout);
+        }
+        if (saved_stderr != -1) {
+            close(saved_stderr);
+        }
+        if (file_fd != -1) {
+            close(file_fd);
+        }
+        return EXIT_FAILURE;
+    }
+    check_sys_call(dup2(out_fd, STDOUT_FILENO), "dup2 failed");
+    check_sys_call(dup2(err_fd, STDERR_FILENO), "dup2 failed");
+    int ret = builtin->run(cmd->argv);
+    fflush(stdout);
+    check_sys_call(dup2(saved_stdout, STDOUT_FILENO), "dup2 failed");
+    check_sys_call(dup2(saved_stderr, STDERR_FILENO), "dup2 failed");
+    close(saved_stdout);
+    close(saved_stderr);
+    if (file_fd != -1) {
+        close(file_fd);
+    }
+    return ret;
+}
+
+
+//this function starts every command of a pipeline as a new job, each with its own pipe to the next, before anything waits for them.
+//the first command reads in_fd, the last writes out_fd, and all of them write errors to err_fd. SIGCHLD must be blocked so the
+//handler cannot reap a command before its pid is in the job table. it returns the job, or NULL if no command could be started
+struct job *launch_job(struct pipeline *pipeline, int background, int in_fd, int out_fd, int err_fd) {
+    struct job *job = NULL;
+    for (int i = 0; i < MAX_JOBS && job == NULL; i++) {
+        if (!jobs[i].in_use) {
+            job = &jobs[i];
+        }
+    }
+    if (job == NULL) {
+        dprintf(err_fd, "ERROR: Too many jobs\n");
+        return NULL;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->in_use = 1;
+    job->background = background;
+    job->sequence = ++job_sequence;
+    job->last_pid = -1;
+    job->status = 127; //what other shells report when the command could not be run
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    snprintf(job->command, sizeof(job->command), "%s", pipeline->text); //the command line as typed, for job listings
+
+    int stage_in = in_fd; //where the next command reads from: in_fd, or the read end of the previous pipe
+    for (struct command *cmd = pipeline->first; cmd != NULL; cmd = cmd->next) {
+        int pipe_fd[2] = {-1, -1}; //file descriptors for the pipe to the next command
+        int stage_out = out_fd;
+
+        if (cmd->next != NULL) {
+            if (pipe2(pipe_fd, O_CLOEXEC) == -1) { //close-on-exec keeps other commands from holding the pipe open
+                dprintf(err_fd, "pipe failed: %s\n", strerror(errno)); //out of descriptors; the commands already started see end of file
                 break;
             }
+            stage_out = pipe_fd[1];
+        }
+
+        pid_t pid = spawn_command(cmd, stage_in, stage_out, err_fd, job->pgid);
+
+        //the shell keeps no pipe ends the child got; only the read end for the next command
+        if (cmd != pipeline->first) {
+            check_sys_call(close(stage_in), "close failed");
+        }
+        if (cmd->next != NULL) {
+            check_sys_call(close(stage_out), "close failed");
+        }
+        stage_in = pipe_fd[0];
+
+        if (pid == -1) {
+            continue; //the rest of the pipeline still runs, and sees end of file or a closed pipe
+        }
+        if (job->pgid == 0 && terminal_fd != -1) {
+            job->pgid = pid; //the first command leads the process group
+        }
+        job->pids[job->num_pids++] = pid;
+        job->running++;
+        if (cmd->next == NULL) {
+            job->last_pid = pid;
+        }
+    }
+    if (stage_in != in_fd && stage_in != -1) {
+        close(stage_in); //a pipe failed, and nothing will read the last one made
+    }
+
+    if (job->num_pids == 0) {
+        job->in_use = 0; //nothing could be started
+        return NULL;
+    }
+    return job;
+}
+
 
-            if (pipe_flag && i < num_commands - 1) { //if the pipe flag is set and its NOT the last command
-                check_sys_call(close(pipe_fd[0]), "close failed"); //the parent process closes the pipe file descriptors to release the resources
-                check_sys_call(close(pipe_fd[1]), "close failed");
+//this function is responsible for executing the parsed command;  handles input/output redirection, piping, and running commands in the background.
+//every command of a pipeline is started before the shell waits for any of them, and together they form one process group tracked as a job.
+//it returns the exit code of the last command of the pipeline
+int execute_command(struct pipeline *pipeline) {
+    if (pipeline->error != NULL) {
+        fprintf(stderr, "ERROR: %s\n", pipeline->error);
+        return 2; //what other shells return for a syntax error
+    }
+    if (pipeline->num_commands == 0) {
+        fprintf(stderr, "ERROR: No command provided\n"); //a blank line, so no command was provided and the error is printed
+        return EXIT_FAILURE;
+    }
+
+    int num_commands = pipeline->num_commands;
+    int background_flag = pipeline->background;
+    int ret = EXIT_FAILURE;
+
+    if (num_commands == 1 && find_builtin(pipeline->first->argv[0]) != NULL) {
+        ret = run_builtin(find_builtin(pipeline->first->argv[0]), pipeline->first, STDOUT_FILENO, STDERR_FILENO); //builtins run inside the shell, without a process
+        num_commands = 0;
+    }
+    fflush(stdout); //anything the shell printed must come out before the commands write to the same stdout
+
+    sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+    if (num_commands > 0) {
+        while (background_flag && count_background_jobs() >= max_background_jobs) {
+            sigset_t mask; //any child finishing wakes the shell to count again
+            sigprocmask(SIG_BLOCK, NULL, &mask);
+            sigdelset(&mask, SIGCHLD);
+            sigsuspend(&mask);
+        }
+        report_finished_jobs(terminal_fd != -1); //finished jobs give their slots up
+
+        struct job *job = launch_job(pipeline, background_flag, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+        if (job == NULL) {
+            ret = 127;
+        } else if (background_flag) { //the parent doesnt wait for a background command
+            if (terminal_fd != -1) {
+                printf("[%d] %d\n", (int)(job - jobs) + 1, (int)job->pgid);
             }
-            waitpid(pid, &status, 0); // here we wait for the child process to change state, and the parent will wait indefinitly for the child process to terminate
-            if (WIFEXITED(status)) { // here we can make sure that the child process is terminated normally and ideally there would be some indication, but I hadn't worked out what that would be.
+            ret = EXIT_SUCCESS;
+        } else {
+            ret = foreground_job(job);
+        }
+    }
+    sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+    return ret;
+}
+
+
+//this function copies a batch command's buffered output to the shell's own stdout or stderr
+void copy_buffered_output(FILE *buffer, FILE *to) {
+    char chunk[8192];
+    size_t n;
+    if (buffer == NULL) {
+        return; //the line was never run, see open_batch_output
+    }
+    rewind(buffer);
+    while ((n = fread(chunk, 1, sizeof(chunk), buffer)) > 0) {
+        fwrite(chunk, 1, n, to);
+    }
+    fclose(buffer);
+}
+
+
+//this function collects batch commands that have finished and prints, in script order, every entry whose turn has come; SIGCHLD must be blocked
+void collect_batch() {
+    for (int i = batch_head; i < batch_tail; i++) {
+        struct batch_entry *entry = &batch[i % BATCH_WINDOW];
+        if (entry->job != NULL && entry->job->running == 0) {
+            struct job *job = entry->job;
+            entry->status = job->status;
+            entry->seconds = (job->finished.tv_sec - job->started.tv_sec) + (job->finished.tv_nsec - job->started.tv_nsec) / 1e9;
+            entry->done = 1;
+            entry->job = NULL;
+            job->in_use = 0;
+            batch_running--;
+        }
+    }
+
+    while (batch_head < batch_tail && batch[batch_head % BATCH_WINDOW].done) {
+        struct batch_entry *entry = &batch[batch_head % BATCH_WINDOW];
+        copy_buffered_output(entry->out, stdout);
+        fflush(stdout);
+        copy_buffered_output(entry->err, stderr);
+        fprintf(stderr, "[line %d] exit %d, %.3f s: %s\n", entry->line_number, entry->status, entry->seconds, entry->command);
+        if (entry->status != 0) {
+            batch_failures++;
+        }
+        last_status = entry->status;
+        free(entry->command);
+        batch_head++;
+    }
+}
+
+
+//this function sleeps until a child changes state, then collects the batch; SIGCHLD must be blocked and a batch command must be running
+void wait_for_batch() {
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    sigsuspend(&mask);
+    collect_batch();
+}
+
+
+//this function works out how many batch lines may hold their output back at once; each one keeps two temporary files open
+int batch_window_size() {
+    struct rlimit limit;
+    long long window = BATCH_WINDOW;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        long long spare = ((long long)limit.rlim_cur - BATCH_FD_RESERVE) / 2;
+        if (spare < window) {
+            window = spare;
+        }
+    }
+    return window > 1 ? (int)window : 1;
+}
+
+
+//this function opens the temporary files that buffer a batch command's output. it returns -1, with neither file open, when they cannot be made
+int open_batch_output(struct batch_entry *entry) {
+    entry->out = tmpfile();
+    entry->err = tmpfile();
+    if (entry->out == NULL || entry->err == NULL) {
+        int saved_errno = errno; //for the caller's perror
+        if (entry->out != NULL) {
+            fclose(entry->out);
+        }
+        if (entry->err != NULL) {
+            fclose(entry->err);
+        }
+        entry->out = NULL;
+        entry->err = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+    fcntl(fileno(entry->out), F_SETFD, FD_CLOEXEC); //other commands must not inherit these
+    fcntl(fileno(entry->err), F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+
+//batch mode (-j): runs the independent command lines of a script with up to workers of them at once. each command's stdout and stderr
+//are buffered in temporary files and printed in script order, followed by a report of its exit code and wall time.
+//it returns EXIT_FAILURE if any command failed
+int run_batch(FILE *script, int workers) {
+    char *line = NULL; //grown by getline to fit the longest line
+    size_t line_size = 0;
+    int line_number = 0; //script line being run
+    struct timespec start, end;
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); //commands must not read the script, which may be on the shell's stdin
+    check_sys_call(null_fd, "open failed");
+    batch_window = batch_window_size();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+
+    while (getline(&line, &line_size, script) != -1) {
+        line_number++;
+        arena_reset(&line_arena);
+        struct pipeline *pipeline = parse_line(&line_arena, line);
+        if (pipeline->error == NULL && pipeline->num_commands == 0) { //blank lines and comments
+            continue;
+        }
+
+        //a free worker and a free slot in the output window are both needed
+        while (batch_running >= workers || batch_tail - batch_head >= batch_window) {
+            wait_for_batch();
+        }
+
+        struct batch_entry *entry = &batch[batch_tail % BATCH_WINDOW];
+        memset(entry, 0, sizeof(*entry));
+        entry->line_number = line_number;
+        //descriptors inherited from the caller can still run out; earlier lines give theirs back once printed
+        while (open_batch_output(entry) == -1 && batch_running > 0) {
+            wait_for_batch();
+        }
+
+        //a trailing & is ignored: every batch command runs alongside the others anyway
+        struct job *job = NULL;
+        entry->status = 127;
+        if (entry->out == NULL) {
+            perror("tmpfile failed"); //nothing is left running to free a descriptor, so this line fails and the batch goes on
+        } else if (pipeline->error != NULL) {
+            fprintf(entry->err, "ERROR: %s\n", pipeline->error);
+            entry->status = 2;
+        } else if (pipeline->num_commands == 1 && find_builtin(pipeline->first->argv[0]) != NULL) {
+            while (find_builtin(pipeline->first->argv[0])->run == builtin_exit && batch_head < batch_tail) {
+                wait_for_batch(); //exit without an argument takes the code of the line before it, which has to finish first
             }
+            fflush(entry->out);
+            entry->status = run_builtin(find_builtin(pipeline->first->argv[0]), pipeline->first, fileno(entry->out), fileno(entry->err));
+        } else {
+            //batch jobs are not background jobs: jobs, wait and the background cap leave them to the batch runner
+            job = launch_job(pipeline, 0, null_fd, fileno(entry->out), fileno(entry->err));
+        }
+        entry->command = strdup(pipeline->text);
+        if (job != NULL) {
+            entry->job = job;
+            batch_running++;
+        } else {
+            entry->done = 1;
         }
+        batch_tail++;
+        collect_batch();
+        if (exit_requested) {
+            break; //commands already started still finish and are reported
+        }
+    }
+
+    while (batch_head < batch_tail) {
+        wait_for_batch();
     }
+    sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+    close(null_fd);
+    free(line);
 
-    for (int i = 0; tokens[i] != NULL; i++) { //we repeat this process for each element in the token array until we reach the end NULL
-        free(tokens[i]); //and after each iteration, I free the up the memory alloted to each token. this is just for memory management
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "%d commands, %d failed, %.3f s\n", batch_head, batch_failures,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    if (exit_requested) {
+        return last_status; //the exit line is the last one printed, so this is the code exit returned
     }
+    return batch_failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 
 //main function where the shell program starts execution.
 int main(int argc, char *argv[]) {
     int interactive_mode = 1; // this enables the interactive mode to indicate that the shell is active and running
-    if (argc > 1 && strcmp(argv[1], "-n") == 0) { // but if the command line argument is -n, which means the shell is to be operated in non-inteteractive mode, the interactive mode is therefore off.
-        interactive_mode = 0;
+    int batch_workers = 0; //-j N runs the script in batch mode with N commands at a time
+    int opt;
+    while ((opt = getopt(argc, argv, "nb:j:")) != -1) {
+        if (opt == 'n') { // but if the command line argument is -n, which means the shell is to be operated in non-inteteractive mode, the interactive mode is therefore off.
+            interactive_mode = 0;
+        } else if (opt == 'b' && atoi(optarg) > 0) { //-b N caps the background jobs running at once; another & waits for one of them to finish
+            max_background_jobs = atoi(optarg) < MAX_JOBS ? atoi(optarg) : MAX_JOBS - 1; //one slot stays free for the foreground
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            batch_workers = atoi(optarg) < MAX_JOBS ? atoi(optarg) : MAX_JOBS; //every running batch command needs a job slot
+            interactive_mode = 0;
+        } else {
+            fprintf(stderr, "usage: %s [-n] [-b max_background_jobs] [-j workers [script]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
     }
 
-    char line[MAX_LINE_LENGTH]; //since we already defined the limits for these variables, here we just declare them
-    char *tokens[MAX_NUM_TOKENS];
+    //finished children are reaped as soon as they exit, so background jobs never linger as zombies
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    action.sa_flags = SA_RESTART; //fgets at the prompt carries on after a background job finishes
+    sigemptyset(&action.sa_mask);
+    check_sys_call(sigaction(SIGCHLD, &action, NULL), "sigaction failed");
+    sigemptyset(&sigchld_set);
+    sigaddset(&sigchld_set, SIGCHLD);
+
+    if (interactive_mode && isatty(STDIN_FILENO)) { //pipelines get their own process groups, and the shell hands them the terminal while they run
+        terminal_fd = STDIN_FILENO;
+        signal(SIGTTOU, SIG_IGN); //taking the terminal back from a background group would otherwise stop the shell
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN); //ctrl-z at the prompt must not stop the shell
+    }
+
+    if (batch_workers > 0) {
+        FILE *script = stdin;
+        if (optind < argc && (script = fopen(argv[optind], "r")) == NULL) {
+            perror(argv[optind]);
+            return EXIT_FAILURE;
+        }
+        return run_batch(script, batch_workers);
+    }
+
+    char *line = NULL; //the input line, which getline grows to fit however long a line is and reuses for the next one
+    size_t line_size = 0;
 
     while (1) { // we use while(1) to indicate that this loop should run continuously until something inside actively terminates it.
         if (interactive_mode) {
+            sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+            report_finished_jobs(1); //like other shells, background jobs that finished are reported before the next prompt
+            sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
             printf("my_shell$ "); // while interactive mode is turned on, the prompt is printed as "my_shell$" indicating an area to type an input
         }
 
-        if (fgets(line, sizeof(line), stdin) == NULL) {  // here we collect the line of input read from standard input stream (STDIN) and store it into the character input of line. But we also only read as many characters as specificed by MAX_LINE_LENGTH. BUT if fgets returns a NULL, there could be an error or...
+        if (getline(&line, &line_size, stdin) == -1) {  // here we collect the line of input read from standard input stream (STDIN) and store it into line, whatever its length. BUT if getline returns -1, there could be an error or...
             if (feof(stdin)) { //the end of input is signalled (i think this could be a ctrl+d on unix)
                 printf("\n");//the newline character is printed to put the prompt on the next line. 
             }
             break;// and breaks out of this MAIN loop
         }
 
-        parse_input(line, tokens); // this calls the parse_input function to tokenize the input line retrieved from the line input and store them in the tokens array; as discussed earlier, this function should be able to recognize the special characters as well.
+        arena_reset(&line_arena); //the previous line's commands are released all at once
+        struct pipeline *pipeline = parse_line(&line_arena, line); // this calls the parse_line function to turn the input line into its commands, arguments and redirections; as discussed earlier, this function should be able to recognize the special characters and quotes as well.
 
-        execute_command(tokens);// this calls the execute_command function to interpret the tokens, handle input/output redirection, piping, and background execution, and then executes the commands.
+        last_status = execute_command(pipeline);// this calls the execute_command function to handle input/output redirection, piping, and background execution, and then executes the commands.
+        if (exit_requested) {
+            break;
+        }
     }
 
-    return 0;
+    free(line);
+    return last_status;
 }